@@ -0,0 +1,99 @@
+#pragma once
+
+#include <limits>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "ImageWriter.h"
+
+using namespace glm;
+
+//what a camera ray found at its first hit
+struct AOVSample
+{
+	float depth{ std::numeric_limits<float>::infinity() };
+	vec3 position{ 0 }; //where the hit is, which with a lens isn't on the ray through the pixel center
+	vec3 normal{ 0 };
+	vec3 albedo{ 0 };
+	int material_id{ -1 };
+};
+
+//Arbitrary output variables: per-pixel first-hit data next to the beauty film.
+//Normal and albedo are averaged over the pixel's samples, depth and position keep the nearest hit
+//and the material ID is taken from the first sample. Position is not an output channel.
+class AOVBuffers
+{
+public:
+	AOVBuffers(int width, int height) : width(width), height(height),
+		depth(width * height, std::numeric_limits<float>::infinity()),
+		position(width * height, vec3(0)),
+		normal(width * height, vec3(0)),
+		albedo(width * height, vec3(0)),
+		material_id(width * height, -1.f),
+		sample_count(width * height, 0.f)
+	{}
+
+	//a pixel is only ever touched by the thread rendering its tile
+	void Add(ivec2 const& pos, AOVSample const& sample)
+	{
+		int i = pos.y * width + pos.x;
+		if (sample_count[i] == 0)
+		{
+			material_id[i] = float(sample.material_id);
+		}
+		if (sample.depth < depth[i])
+		{
+			depth[i] = sample.depth;
+			position[i] = sample.position;
+		}
+		normal[i] += sample.normal;
+		albedo[i] += sample.albedo;
+		sample_count[i] += 1.f;
+	}
+
+	float Depth(ivec2 const& pos) const { return depth[pos.y * width + pos.x]; }
+	vec3 const& Position(ivec2 const& pos) const { return position[pos.y * width + pos.x]; }
+	float MaterialID(ivec2 const& pos) const { return material_id[pos.y * width + pos.x]; }
+	float SampleCount(ivec2 const& pos) const { return sample_count[pos.y * width + pos.x]; }
+
+	vec3 Normal(ivec2 const& pos) const
+	{
+		int i = pos.y * width + pos.x;
+		return (sample_count[i] > 0) ? normal[i] / sample_count[i] : vec3(0);
+	}
+
+	vec3 Albedo(ivec2 const& pos) const
+	{
+		int i = pos.y * width + pos.x;
+		return (sample_count[i] > 0) ? albedo[i] / sample_count[i] : vec3(0);
+	}
+
+	//EXR channel layout, following the usual naming for depth and normals
+	std::vector<OutputChannel> Channels() const
+	{
+		return {
+			{ "Z", [this](Film const&, ivec2 const& p) { return Depth(p); } },
+			{ "N.X", [this](Film const&, ivec2 const& p) { return Normal(p).x; } },
+			{ "N.Y", [this](Film const&, ivec2 const& p) { return Normal(p).y; } },
+			{ "N.Z", [this](Film const&, ivec2 const& p) { return Normal(p).z; } },
+			{ "albedo.R", [this](Film const&, ivec2 const& p) { return Albedo(p).r; } },
+			{ "albedo.G", [this](Film const&, ivec2 const& p) { return Albedo(p).g; } },
+			{ "albedo.B", [this](Film const&, ivec2 const& p) { return Albedo(p).b; } },
+			{ "materialID", [this](Film const&, ivec2 const& p) { return MaterialID(p); } },
+			{ "samples", [this](Film const&, ivec2 const& p) { return SampleCount(p); } },
+		};
+	}
+
+	int Width() const { return width; }
+	int Height() const { return height; }
+
+private:
+	int width, height;
+	std::vector<float> depth;
+	std::vector<vec3> position;
+	std::vector<vec3> normal;
+	std::vector<vec3> albedo;
+	std::vector<float> material_id;
+	std::vector<float> sample_count;
+};
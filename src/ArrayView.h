@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+//Read-only view of a contiguous array that something else owns: a vector, or a mapped file
+template <typename T>
+class ArrayView
+{
+public:
+	ArrayView() {}
+	ArrayView(T const* data, size_t count) : data__(data), count__(count) {}
+	ArrayView(std::vector<T> const& v) : data__(v.data()), count__(v.size()) {}
+
+	T const& operator[](size_t i) const { return data__[i]; }
+	T const* data() const { return data__; }
+	size_t size() const { return count__; }
+	bool empty() const { return count__ == 0; }
+	T const* begin() const { return data__; }
+	T const* end() const { return data__ + count__; }
+
+private:
+	T const* data__{ nullptr };
+	size_t count__{ 0 };
+};
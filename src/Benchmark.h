@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "Config.h"
+#include "Kernels.h"
+#include "RayCounter.h"
+#include "Scene.h"
+
+using namespace glm;
+
+//Canonical scenes rendered the same way every time, so numbers from different builds and
+//machines can be compared. Only the thread count and BVH build come from the command line.
+namespace benchmark
+{
+	int const WIDTH = 320;
+	int const HEIGHT = 180;
+	int const SAMPLES = 16;
+	int const MAX_DEPTH = 8;
+
+	struct SceneSpec
+	{
+		std::string name;
+		std::function<void(geometry::Scene&)> build;
+	};
+
+	struct Result
+	{
+		std::string name;
+		size_t spheres, triangles, nodes;
+		double scene_seconds, bvh_seconds, render_seconds;
+		uint64_t rays[int(RayType::Count)];
+	};
+
+	//the settings every scene renders with, before the scene's own camera is applied
+	inline RenderSettings render_settings(RenderSettings const& base)
+	{
+		RenderSettings fixed;
+		fixed.width = WIDTH;
+		fixed.height = HEIGHT;
+		fixed.samples = SAMPLES;
+		fixed.max_depth = MAX_DEPTH;
+		fixed.threads = base.threads;
+		fixed.seed = base.seed;
+		fixed.bvh = base.bvh;
+		fixed.outputs.clear();
+		return fixed;
+	}
+
+	//a rippled heightfield of resolution x resolution quads with smooth normals, lit by one lamp
+	inline void build_dense_mesh(geometry::Scene& scene, int resolution)
+	{
+		uint32_t clay = scene.AddMaterial({ MaterialType::Lambertian, vec3(0.7f, 0.6f, 0.5f), 0 });
+		uint32_t lamp = scene.AddMaterial({ MaterialType::Light, vec3(8.f), 0 });
+		float const size = 8.f;
+		std::vector<MeshVertex> vertices;
+		vertices.reserve(size_t(resolution + 1) * (resolution + 1));
+		for (int j = 0; j <= resolution; ++j)
+		{
+			for (int i = 0; i <= resolution; ++i)
+			{
+				vec2 uv = vec2(i, j) / float(resolution);
+				float x = (uv.x - 0.5f) * size, z = (uv.y - 0.5f) * size;
+				float y = 0.3f * sin(3.f * x) * cos(2.5f * z) + 0.1f * sin(11.f * x + 7.f * z);
+				float dydx = 0.9f * cos(3.f * x) * cos(2.5f * z) + 1.1f * cos(11.f * x + 7.f * z);
+				float dydz = -0.75f * sin(3.f * x) * sin(2.5f * z) + 0.7f * cos(11.f * x + 7.f * z);
+				vertices.push_back(MeshVertex{ vec3(x, y, z), normalize(vec3(-dydx, 1.f, -dydz)), uv });
+			}
+		}
+		uint32_t first = uint32_t(scene.vertices.size());
+		scene.AddVertices(vertices);
+		std::vector<TrianglePrimitive> triangles;
+		triangles.reserve(size_t(resolution) * resolution * 2);
+		for (int j = 0; j < resolution; ++j)
+		{
+			for (int i = 0; i < resolution; ++i)
+			{
+				uint32_t v = first + uint32_t(j * (resolution + 1) + i);
+				uint32_t row = uint32_t(resolution + 1);
+				triangles.push_back(TrianglePrimitive{ v, v + row, v + 1, clay });
+				triangles.push_back(TrianglePrimitive{ v + 1, v + row, v + row + 1, clay });
+			}
+		}
+		scene.AddTriangles(triangles);
+		scene.AddSphere(vec3(1.f, 4.f, -1.f), 0.5f, lamp);
+		scene.settings = { { "camera-position", "0,4,-7" }, { "camera-lookat", "0,0,0" }, { "fov", "50" }, { "aperture", "0" } };
+	}
+
+	//mostly refraction: a grid of glass balls on a floor, with a few mirrors and one lamp
+	inline void build_glass_scene(geometry::Scene& scene)
+	{
+		uint32_t floor = scene.AddMaterial({ MaterialType::Lambertian, vec3(0.5f), 0 });
+		uint32_t glass = scene.AddMaterial({ MaterialType::Dielectric, vec3(1), 1.5f });
+		uint32_t mirror = scene.AddMaterial({ MaterialType::Metal, vec3(0.9f), 0 });
+		uint32_t lamp = scene.AddMaterial({ MaterialType::Light, vec3(6.f), 0 });
+		scene.AddSphere(vec3(0, -1000, 0), 1000, floor);
+		for (int a = -3; a <= 3; ++a)
+		{
+			for (int b = -3; b <= 3; ++b)
+			{
+				bool is_mirror = (a + b) % 4 == 0;
+				scene.AddSphere(vec3(a, 0.45f, b), 0.45f, is_mirror ? mirror : glass);
+			}
+		}
+		scene.AddSphere(vec3(0, 5, 0), 1.f, lamp);
+		scene.settings = { { "camera-position", "6,3,-6" }, { "camera-lookat", "0,0.3,0" }, { "fov", "45" }, { "aperture", "0" } };
+	}
+
+	inline void write_json_string(FILE* file, std::string const& s)
+	{
+		fputc('"', file);
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\')
+			{
+				fputc('\\', file);
+			}
+			fputc(c, file);
+		}
+		fputc('"', file);
+	}
+
+	//One object per scene with sizes, timings and throughput; times in seconds
+	inline bool write_report(std::string const& path, RenderSettings const& settings, int threads, std::vector<Result> const& results)
+	{
+		FILE* file = fopen(path.c_str(), "w");
+		if (!file)
+		{
+			std::cerr << "Could not write benchmark report " << path << std::endl;
+			return false;
+		}
+		fprintf(file, "{\n  \"threads\": %d,\n  \"seed\": %d,\n  \"bvh\": \"%s\",\n  \"isa\": \"%s\",\n", threads, settings.seed,
+			settings.bvh == geometry::BVHBuild::SAH ? "sah" : "median", cpu::name(kernels::active().isa));
+		fprintf(file, "  \"width\": %d,\n  \"height\": %d,\n  \"spp\": %d,\n  \"depth\": %d,\n  \"scenes\": [", WIDTH, HEIGHT, SAMPLES, MAX_DEPTH);
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			Result const& r = results[i];
+			uint64_t total = 0;
+			for (uint64_t count : r.rays)
+			{
+				total += count;
+			}
+			double render_seconds = glm::max(r.render_seconds, 1e-9);
+			fprintf(file, "%s\n    {\n      \"name\": ", i ? "," : "");
+			write_json_string(file, r.name);
+			fprintf(file, ",\n      \"spheres\": %zu,\n      \"triangles\": %zu,\n      \"bvh_nodes\": %zu,\n", r.spheres, r.triangles, r.nodes);
+			fprintf(file, "      \"scene_seconds\": %.6f,\n      \"bvh_seconds\": %.6f,\n      \"render_seconds\": %.6f,\n",
+				r.scene_seconds, r.bvh_seconds, r.render_seconds);
+			fprintf(file, "      \"rays\": {");
+			for (int type = 0; type < int(RayType::Count); ++type)
+			{
+				fprintf(file, " \"%s\": %llu,", RayCounter::Name(RayType(type)), (unsigned long long)r.rays[type]);
+			}
+			fprintf(file, " \"total\": %llu },\n      \"rays_per_second\": {", (unsigned long long)total);
+			for (int type = 0; type < int(RayType::Count); ++type)
+			{
+				fprintf(file, " \"%s\": %.1f,", RayCounter::Name(RayType(type)), r.rays[type] / render_seconds);
+			}
+			fprintf(file, " \"total\": %.1f },\n", total / render_seconds);
+			fprintf(file, "      \"mrays_per_second\": %.3f,\n      \"spp_per_second\": %.1f\n    }",
+				total / render_seconds * 1e-6, double(WIDTH) * HEIGHT * SAMPLES / render_seconds);
+		}
+		fprintf(file, "\n  ]\n}\n");
+		bool ok = fclose(file) == 0;
+		if (!ok)
+		{
+			std::cerr << "Could not write benchmark report " << path << std::endl;
+		}
+		return ok;
+	}
+}
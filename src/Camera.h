@@ -4,13 +4,15 @@
 #include <3rdparty/glm/gtc/random.hpp>
 #include <3rdparty/glm/gtc/quaternion.hpp>
 #include "ray.h"
+#include "rt_math.h"
 
 using namespace glm;
 
 enum class Randomization
 {
 	None, 
-	MonteCarlo
+	MonteCarlo,
+	Stratified //jittered on a sqrt(count) x sqrt(count) grid
 };
 
 class Camera
@@ -30,8 +32,63 @@ public:
 
 	Ray make_ray(ivec2 const & image_pos, Randomization rand) const
 	{
-		//offset from pixel top-left
+		return make_ray(vec2(image_pos) + pixel_offset(rand));
+	}
+
+	//image_pos is continuous, pixel (x, y) covers [x, x+1) x [y, y+1).
+	//The differentials go through the next pixels over from the same lens position.
+	//The time is uniform over the shutter interval.
+	Ray make_ray(vec2 const & image_pos) const
+	{
+		vec2 lensOffset = sample_in_disk(vec2(0.f), vec2(aperture * 0.5f));
+		vec3 origin = location + u * lensOffset.x + v * lensOffset.y;
+		Ray r(origin, direction_through(image_pos, origin), linearRand(shutter.x, shutter.y));
+		r.has_differentials = true;
+		r.rx_origin = r.ry_origin = origin;
+		r.rx_direction = direction_through(image_pos + vec2(1, 0), origin);
+		r.ry_direction = direction_through(image_pos + vec2(0, 1), origin);
+		return r;
+	}
+
+	//direction from the center of the lens through image_pos
+	vec3 pinhole_direction(vec2 const& image_pos) const
+	{
+		return direction_through(image_pos, location);
+	}
+
+	//distance of a point in front of the lens along the view axis
+	float view_depth(vec3 const& point) const
+	{
+		return -dot(point - location, w);
+	}
+
+	//the point at view_depth on the ray through the center of the lens and image_pos
+	vec3 unproject(vec2 const& image_pos, float depth) const
+	{
+		vec3 direction = pinhole_direction(image_pos);
+		return location + direction * (depth / -dot(direction, w));
+	}
+
+	//where a point is seen through the center of the lens, the inverse of pinhole_direction;
+	//false for points behind the camera
+	bool project(vec3 const& point, vec2& image_pos) const
+	{
+		vec3 d = point - location;
+		float depth = view_depth(point);
+		if (depth <= 0)
+		{
+			return false;
+		}
+		vec2 st = vec2(dot(d, u), dot(d, v)) / depth;
+		image_pos = st / imageplane_dims__ + half_img_size__;
+		return true;
+	}
+
+	//offset from pixel top-left for the index-th of count samples
+	static vec2 pixel_offset(Randomization rand, int index = 0, int count = 1)
+	{
 		vec2 offset_imgplane(0.5, 0.5);
+		int strata = int(sqrt(float(count)));
 		switch (rand)
 		{
 		case Randomization::None: 
@@ -39,15 +96,21 @@ public:
 		case Randomization::MonteCarlo:
 			offset_imgplane += linearRand(vec2(-0.5), vec2(0.5));
 			break;
+		case Randomization::Stratified:
+			//samples beyond the largest square grid are jittered over the whole pixel
+			if (index < strata * strata)
+			{
+				offset_imgplane = (vec2(index % strata, index / strata) + linearRand(vec2(0.f), vec2(1.f))) / float(strata);
+			}
+			else
+			{
+				offset_imgplane += linearRand(vec2(-0.5), vec2(0.5));
+			}
+			break;
 		default:
 			break;
 		}
-		
-		vec2 pos_imgplane = (vec2(image_pos) + offset_imgplane - half_img_size__);
-		vec2 lensOffset = sample_in_disk(vec2(0.f), vec2(aperture * 0.5f));
-		vec2 st = pos_imgplane * imageplane_dims__;
-		vec3 pos_worldspace = location + focus_dist * (-w + u * st.x + v * st.y);
-		return Ray(location + u * lensOffset.x + v * lensOffset.y, normalize(pos_worldspace - location - u * lensOffset.x - v * lensOffset.y));
+		return offset_imgplane;
 	}
 
 	void set_fov_h(float degrees)
@@ -65,11 +128,25 @@ public:
 		calc_image_plane();
 	}
 	
+	//scene time in [0, 1] over which the shutter is open
+	void set_shutter(float open, float close)
+	{
+		shutter = clamp(vec2(open, max(open, close)), 0.f, 1.f);
+	}
+
 	float aperture{0};
 	vec3 location;
 
 private:
 
+	//towards the point on the focus plane that image_pos maps to
+	vec3 direction_through(vec2 const& image_pos, vec3 const& origin) const
+	{
+		vec2 st = (image_pos - half_img_size__) * imageplane_dims__;
+		vec3 pos_worldspace = location + focus_dist * (-w + u * st.x + v * st.y);
+		return normalize(pos_worldspace - origin);
+	}
+
 	void calc_image_plane()
 	{
 		float inv_aspect_ratio = image_size.y * 1.f / image_size.x;
@@ -83,6 +160,7 @@ private:
 	vec2 imageplane_dims__;
 	float pixel_scale__;
 	
+	vec2 shutter{ 0 };
 	float focus_dist{ 1 };
 	float fov_h{ 90 };
 };
\ No newline at end of file
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "Camera.h"
+#include "Cpu.h"
+#include "Film.h"
+#include "Filter.h"
+#include "geometry.h"
+
+using namespace glm;
+
+//Everything a render run can be told from outside, defaults match the built-in scene
+struct RenderSettings
+{
+	int width{ 512 };
+	int height{ 256 };
+	int samples{ 256 };
+	int max_depth{ 8 };
+	int threads{ 0 }; //0 leaves it to OpenMP
+	//for the random number generator, so runs repeat; exactly only on a single thread
+	int seed{ 1 };
+	int tile_size{ DEFAULT_TILE_SIZE };
+	//SIMD kernels to use, at most what the processor supports
+	cpu::Isa isa{ cpu::detect() };
+	Randomization sampler{ Randomization::MonteCarlo };
+	geometry::BVHBuild bvh{ geometry::BVHBuild::Median };
+
+	//.png is written once rendering is done, .hdr and .exr are written tile by tile as they finish
+	std::vector<std::string> outputs{ "image.png" };
+	//first-hit depth, normal, albedo, material ID and sample count; go into the EXR if there is one, otherwise into <name>.aovs.exr
+	bool aovs{ false };
+	//edge-aware filter guided by the normal and albedo AOVs, run after tracing
+	bool denoise{ false };
+	//pixel reconstruction filter; anything wider than the box splats into neighbouring pixels
+	FilterType filter{ FilterType::Box };
+	float filter_radius{ 0.5f };
+
+	//text scene file (see SceneFile.h) or a Wavefront OBJ; the built-in random scene if empty
+	std::string scene;
+	//binary copy of the scene with its BVH; used when it matches the scene file, otherwise written
+	std::string scene_cache;
+	//memory for decoded texture tiles, in MB
+	int texture_cache{ 256 };
+
+	//per-pixel traversal cost, .png in false color or .hdr; needs a build with statistics (see Stats.h)
+	std::string heatmap;
+	//timeline of render phases and tiles per thread, Chrome trace JSON written at exit
+	std::string trace;
+	//renders the benchmark scenes instead and writes their timings as JSON to this path
+	std::string benchmark;
+
+	//distributed rendering (see Distributed.h): the address to hand out tiles on, or the coordinator to work for
+	std::string coordinator;
+	std::string worker;
+	//seconds a worker holding tiles may go without sending a result before they're handed to others, 0 for no limit
+	int worker_timeout{ 300 };
+	//render server (see Server.h): where requests come from, "-" for stdin, and how many scenes it keeps loaded
+	std::string serve;
+	int resident_scenes{ 4 };
+	//requests are unauthenticated, so a server only listens beyond this machine when told to
+	bool serve_remote{ false };
+
+	//optional HDR sky, replaces the gradient
+	std::string environment;
+
+	vec3 camera_position{ 8.5f, 1.8f, -2.4f };
+	vec3 camera_lookat{ 0.f, 0.f, 0.f };
+	vec3 camera_up{ 0.f, 1.f, 0.f };
+	float fov{ 58.f };
+	float aperture{ 0.075f };
+	float focus_distance{ 5.16236f };
+	//part of the scene's [0, 1] time the shutter is open for; moving spheres blur over it
+	float shutter_open{ 0.f };
+	float shutter_close{ 0.f };
+
+	//reuse the previous frame of a camera sequence rendered by the same renderer (as in a server), see Temporal.h
+	bool temporal{ false };
+
+	//pixel rectangle to render as (min, max) with max exclusive, empty for the whole frame.
+	//Rays are generated as for the full frame, so crops of the same frame composite seamlessly.
+	ivec4 region{ 0 };
+};
+
+namespace config
+{
+	inline std::string trim(std::string const& s)
+	{
+		size_t first = s.find_first_not_of(" \t\r\n");
+		if (first == std::string::npos)
+		{
+			return "";
+		}
+		size_t last = s.find_last_not_of(" \t\r\n");
+		return s.substr(first, last - first + 1);
+	}
+
+	inline std::vector<std::string> split(std::string const& s, char separator)
+	{
+		std::vector<std::string> parts;
+		std::stringstream stream(s);
+		std::string part;
+		while (std::getline(stream, part, separator))
+		{
+			parts.push_back(trim(part));
+		}
+		return parts;
+	}
+
+	inline bool parse(std::string const& value, int& out)
+	{
+		char* end;
+		long v = strtol(value.c_str(), &end, 10);
+		if (value.empty() || *end != 0)
+		{
+			return false;
+		}
+		out = int(v);
+		return true;
+	}
+
+	inline bool parse(std::string const& value, float& out)
+	{
+		char* end;
+		float v = strtof(value.c_str(), &end);
+		if (value.empty() || *end != 0)
+		{
+			return false;
+		}
+		out = v;
+		return true;
+	}
+
+	inline bool parse(std::string const& value, bool& out)
+	{
+		if (value == "1" || value == "true" || value == "on" || value == "yes")
+		{
+			out = true;
+			return true;
+		}
+		if (value == "0" || value == "false" || value == "off" || value == "no")
+		{
+			out = false;
+			return true;
+		}
+		return false;
+	}
+
+	//"x,y,z"
+	inline bool parse(std::string const& value, vec3& out)
+	{
+		std::vector<std::string> parts = split(value, ',');
+		if (parts.size() != 3)
+		{
+			return false;
+		}
+		return parse(parts[0], out.x) && parse(parts[1], out.y) && parse(parts[2], out.z);
+	}
+
+	//"x0,y0,x1,y1"
+	inline bool parse(std::string const& value, ivec4& out)
+	{
+		std::vector<std::string> parts = split(value, ',');
+		if (parts.size() != 4)
+		{
+			return false;
+		}
+		return parse(parts[0], out.x) && parse(parts[1], out.y) && parse(parts[2], out.z) && parse(parts[3], out.w);
+	}
+
+	inline bool parse(std::string const& value, Randomization& out)
+	{
+		if (value == "center") { out = Randomization::None; return true; }
+		if (value == "random") { out = Randomization::MonteCarlo; return true; }
+		if (value == "stratified") { out = Randomization::Stratified; return true; }
+		return false;
+	}
+
+	inline bool parse(std::string const& value, geometry::BVHBuild& out)
+	{
+		if (value == "median") { out = geometry::BVHBuild::Median; return true; }
+		if (value == "sah") { out = geometry::BVHBuild::SAH; return true; }
+		return false;
+	}
+
+	inline bool parse(std::string const& value, FilterType& out)
+	{
+		if (value == "box") { out = FilterType::Box; return true; }
+		if (value == "gaussian") { out = FilterType::Gaussian; return true; }
+		if (value == "mitchell") { out = FilterType::Mitchell; return true; }
+		if (value == "blackman-harris") { out = FilterType::BlackmanHarris; return true; }
+		return false;
+	}
+
+	inline bool parse(std::string const& value, cpu::Isa& out)
+	{
+		if (value == "auto") { out = cpu::detect(); return true; }
+		return cpu::from_name(value, out);
+	}
+
+	//sets one key, returns false and complains for unknown keys and malformed values
+	inline bool apply(RenderSettings& settings, std::string const& key, std::string const& value)
+	{
+		bool ok;
+		if (key == "width") ok = parse(value, settings.width) && settings.width > 0;
+		else if (key == "height") ok = parse(value, settings.height) && settings.height > 0;
+		else if (key == "spp") ok = parse(value, settings.samples) && settings.samples > 0;
+		else if (key == "depth") ok = parse(value, settings.max_depth) && settings.max_depth >= 0;
+		else if (key == "threads") ok = parse(value, settings.threads) && settings.threads >= 0;
+		else if (key == "seed") ok = parse(value, settings.seed) && settings.seed >= 0;
+		else if (key == "isa") ok = parse(value, settings.isa);
+		else if (key == "tile-size") ok = parse(value, settings.tile_size) && settings.tile_size > 0;
+		else if (key == "region") ok = parse(value, settings.region) && settings.region.x >= 0 && settings.region.y >= 0
+			&& settings.region.z >= settings.region.x && settings.region.w >= settings.region.y;
+		else if (key == "sampler") ok = parse(value, settings.sampler);
+		else if (key == "bvh") ok = parse(value, settings.bvh);
+		else if (key == "output") { settings.outputs = split(value, ','); ok = !value.empty(); }
+		else if (key == "aovs") ok = parse(value, settings.aovs);
+		else if (key == "denoise") ok = parse(value, settings.denoise);
+		else if (key == "temporal") ok = parse(value, settings.temporal);
+		else if (key == "filter") ok = parse(value, settings.filter);
+		else if (key == "filter-radius") ok = parse(value, settings.filter_radius) && settings.filter_radius >= 0.5f;
+		else if (key == "scene") { settings.scene = value; ok = !value.empty(); }
+		else if (key == "scene-cache") { settings.scene_cache = value; ok = true; }
+		else if (key == "texture-cache") ok = parse(value, settings.texture_cache) && settings.texture_cache > 0;
+		else if (key == "heatmap") { settings.heatmap = value; ok = !value.empty(); }
+		else if (key == "trace") { settings.trace = value; ok = !value.empty(); }
+		else if (key == "benchmark") { settings.benchmark = value; ok = !value.empty(); }
+		else if (key == "coordinator") { settings.coordinator = value; ok = !value.empty(); }
+		else if (key == "worker") { settings.worker = value; ok = !value.empty(); }
+		else if (key == "worker-timeout") ok = parse(value, settings.worker_timeout) && settings.worker_timeout >= 0;
+		else if (key == "serve") { settings.serve = value; ok = !value.empty(); }
+		else if (key == "resident-scenes") ok = parse(value, settings.resident_scenes) && settings.resident_scenes > 0;
+		else if (key == "serve-remote") ok = parse(value, settings.serve_remote);
+		else if (key == "environment") { settings.environment = value; ok = true; }
+		else if (key == "camera-position") ok = parse(value, settings.camera_position);
+		else if (key == "camera-lookat") ok = parse(value, settings.camera_lookat);
+		else if (key == "camera-up") ok = parse(value, settings.camera_up);
+		else if (key == "fov") ok = parse(value, settings.fov);
+		else if (key == "aperture") ok = parse(value, settings.aperture);
+		else if (key == "focus-distance") ok = parse(value, settings.focus_distance);
+		else if (key == "shutter-open") ok = parse(value, settings.shutter_open) && settings.shutter_open >= 0 && settings.shutter_open <= 1;
+		else if (key == "shutter-close") ok = parse(value, settings.shutter_close) && settings.shutter_close >= 0 && settings.shutter_close <= 1;
+		else
+		{
+			std::cerr << "Unknown setting '" << key << "'" << std::endl;
+			return false;
+		}
+		if (!ok)
+		{
+			std::cerr << "Bad value '" << value << "' for '" << key << "'" << std::endl;
+		}
+		return ok;
+	}
+
+	//key = value per line, '#' starts a comment
+	inline bool load_file(RenderSettings& settings, std::string const& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			std::cerr << "Could not open config " << path << std::endl;
+			return false;
+		}
+		std::string line;
+		int line_number = 0;
+		while (std::getline(file, line))
+		{
+			++line_number;
+			line = trim(line.substr(0, line.find('#')));
+			if (line.empty())
+			{
+				continue;
+			}
+			size_t equals = line.find('=');
+			if (equals == std::string::npos)
+			{
+				std::cerr << path << ":" << line_number << ": expected key = value" << std::endl;
+				return false;
+			}
+			if (!apply(settings, trim(line.substr(0, equals)), trim(line.substr(equals + 1))))
+			{
+				std::cerr << path << ":" << line_number << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	inline void print_usage(char const* program)
+	{
+		std::cout << "usage: " << program << " [--config file] [--key=value | --key value]... [environment.hdr]\n"
+			"  width, height, spp, depth, threads, tile-size, seed\n"
+			"  isa              auto | generic | sse4.2 | avx2 | avx512, SIMD kernels to use\n"
+			"  region           x0,y0,x1,y1 pixels to render (max exclusive), the rest of the image stays black\n"
+			"  sampler          center | random | stratified\n"
+			"  bvh              median | sah\n"
+			"  output           comma separated list of .png, .hdr, .exr paths\n"
+			"  aovs, denoise    true | false\n"
+			"  temporal         true | false, reproject the previous frame a server rendered of the scene\n"
+			"  filter           box | gaussian | mitchell | blackman-harris\n"
+			"  filter-radius    in pixels, at least 0.5\n"
+			"  scene            scene description or .obj file\n"
+			"  scene-cache      binary scene and BVH, loaded if up to date, otherwise written\n"
+			"  texture-cache    MB of decoded texture tiles kept in memory\n"
+			"  heatmap          traversal cost per pixel as .png or .hdr, in builds with RT_STATS\n"
+			"  trace            Chrome trace JSON of phases and tiles, for chrome://tracing or Perfetto\n"
+			"  benchmark        render the benchmark scenes and write a JSON report here\n"
+			"  coordinator      host:port or unix:/path to hand out tiles to workers on, instead of rendering\n"
+			"  worker           host:port or unix:/path of a coordinator to render tiles for\n"
+			"  worker-timeout   seconds without a result before a worker's tiles go to others, 0 for no limit\n"
+			"  serve            unix:/path, host:port or - for stdin: answer render requests, one line of key=value each\n"
+			"  resident-scenes  scenes a server keeps loaded with their BVH\n"
+			"  serve-remote     true | false, allow serve addresses other hosts can reach (anyone there can render)\n"
+			"  environment      HDR lat-long sky\n"
+			"  camera-position, camera-lookat, camera-up   x,y,z\n"
+			"  fov, aperture, focus-distance\n"
+			"  shutter-open, shutter-close   scene time in [0, 1], equal for no motion blur\n"
+			"Later options override earlier ones, including those from config files.\n"
+			"Camera and environment given on the command line override those from the scene." << std::endl;
+	}
+
+	//Applies command line options in order, args[0] being the program. Returns false on errors or when only help was asked for.
+	inline bool parse_command_line(RenderSettings& settings, std::vector<std::string> const& args)
+	{
+		int argc = int(args.size());
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = args[i];
+			if (arg == "-h" || arg == "--help")
+			{
+				print_usage(args[0].c_str());
+				return false;
+			}
+			if (arg.compare(0, 2, "--") != 0)
+			{
+				//a bare argument is the environment map, as before there were options
+				settings.environment = arg;
+				continue;
+			}
+			std::string key = arg.substr(2), value;
+			size_t equals = key.find('=');
+			if (equals != std::string::npos)
+			{
+				value = key.substr(equals + 1);
+				key = key.substr(0, equals);
+			}
+			else if (i + 1 < argc)
+			{
+				value = args[++i];
+			}
+			else
+			{
+				std::cerr << "Missing value for --" << key << std::endl;
+				return false;
+			}
+			bool ok = (key == "config") ? load_file(settings, value) : apply(settings, key, value);
+			if (!ok)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	inline bool parse_command_line(RenderSettings& settings, int argc, char** argv)
+	{
+		return parse_command_line(settings, std::vector<std::string>(argv, argv + argc));
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <initializer_list>
+#include <string>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+//What the processor we run on can execute, as the levels the SIMD kernels are built for
+namespace cpu
+{
+	enum class Isa
+	{
+		Generic,
+		SSE42,
+		AVX2, //with FMA and BMI2
+		AVX512, //F, BW, DQ and VL
+	};
+
+	inline char const* name(Isa isa)
+	{
+		switch (isa)
+		{
+		case Isa::SSE42: return "sse4.2";
+		case Isa::AVX2: return "avx2";
+		case Isa::AVX512: return "avx512";
+		default: return "generic";
+		}
+	}
+
+	inline bool from_name(std::string const& isa_name, Isa& isa)
+	{
+		for (Isa candidate : { Isa::Generic, Isa::SSE42, Isa::AVX2, Isa::AVX512 })
+		{
+			if (isa_name == name(candidate))
+			{
+				isa = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//the highest level both the processor and the OS (for the wider registers) support
+	inline Isa detect()
+	{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+			__builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+		{
+			return Isa::AVX512;
+		}
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi2"))
+		{
+			return Isa::AVX2;
+		}
+		if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+		{
+			return Isa::SSE42;
+		}
+		return Isa::Generic;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int info[4];
+		__cpuid(info, 0);
+		int max_leaf = info[0];
+		__cpuid(info, 1);
+		bool sse42 = (info[2] & (1 << 20)) && (info[2] & (1 << 23));
+		bool fma = (info[2] & (1 << 12)) != 0;
+		//the OS saves the AVX (and AVX-512) registers on context switches
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+		bool avx_state = (xcr0 & 0x6) == 0x6;
+		bool avx512_state = (xcr0 & 0xe6) == 0xe6;
+		if (max_leaf < 7)
+		{
+			return sse42 ? Isa::SSE42 : Isa::Generic;
+		}
+		__cpuidex(info, 7, 0);
+		bool avx2 = fma && avx_state && (info[1] & (1 << 5)) && (info[1] & (1 << 8));
+		bool avx512 = avx2 && avx512_state && (info[1] & (1 << 16)) && (info[1] & (1 << 17)) &&
+			(info[1] & (1 << 30)) && (info[1] & (1u << 31));
+		return avx512 ? Isa::AVX512 : avx2 ? Isa::AVX2 : sse42 ? Isa::SSE42 : Isa::Generic;
+#else
+		return Isa::Generic;
+#endif
+	}
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "Film.h"
+#include "AOV.h"
+
+using namespace glm;
+
+//Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010).
+//Each pass blurs with a 5x5 B3-spline kernel whose taps are spread 2^i pixels apart, and drops
+//the weight of neighbours whose color, normal or albedo differ from the center. Lighting is
+//divided by the albedo before filtering and multiplied back after, so texture detail survives.
+class Denoiser
+{
+public:
+	int iterations{ 5 };
+	float sigma_color{ 1.f };
+	float sigma_normal{ 0.3f };
+	float sigma_albedo{ 0.1f };
+
+	//denoises 'film' into 'out', which must have the same size; out gets weight 1 per pixel
+	void Apply(Film const& film, AOVBuffers const& aovs, Film& out)
+	{
+		width = film.Width();
+		height = film.Height();
+		int pixels = width * height;
+		for (int c = 0; c < 3; ++c)
+		{
+			color[c].resize(pixels);
+			scratch[c].resize(pixels);
+			normal[c].resize(pixels);
+			albedo[c].resize(pixels);
+		}
+
+		//planar copies, so the filter loops run over contiguous floats
+		#pragma omp parallel for schedule(static)
+		for (int y = 0; y < height; ++y)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				int i = y * width + x;
+				vec3 c = film.Resolve(ivec2(x, y));
+				vec3 n = aovs.Normal(ivec2(x, y));
+				vec3 a = aovs.Albedo(ivec2(x, y));
+				for (int k = 0; k < 3; ++k)
+				{
+					color[k][i] = c[k] / Demodulation(a[k]);
+					normal[k][i] = n[k];
+					albedo[k][i] = a[k];
+				}
+			}
+		}
+
+		for (int iteration = 0; iteration < iterations; ++iteration)
+		{
+			int step = 1 << iteration;
+			//later passes see an already smoother signal, so they get less tolerant of color changes
+			float inv_sigma_color2 = 1.f / (sigma_color * sigma_color) * float(1 << (2 * iteration));
+			#pragma omp parallel for schedule(dynamic)
+			for (int tile = 0; tile < film.TileCount(); ++tile)
+			{
+				FilterTile(film.TileBounds(tile), step, inv_sigma_color2);
+			}
+			for (int c = 0; c < 3; ++c)
+			{
+				std::swap(color[c], scratch[c]);
+			}
+		}
+
+		out.Clear();
+		#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < out.TileCount(); ++tile)
+		{
+			ivec4 bounds = out.TileBounds(tile);
+			for (int y = bounds.y; y < bounds.w; ++y)
+			{
+				for (int x = bounds.x; x < bounds.z; ++x)
+				{
+					int i = y * width + x;
+					vec3 c;
+					for (int k = 0; k < 3; ++k)
+					{
+						c[k] = color[k][i] * Demodulation(albedo[k][i]);
+					}
+					out.Add(ivec2(x, y), c);
+				}
+			}
+		}
+	}
+
+private:
+
+	//pixels without albedo (sky, lights) are filtered as they are
+	static float Demodulation(float albedo)
+	{
+		return (albedo > 1e-3f) ? albedo : 1.f;
+	}
+
+	void FilterTile(ivec4 const& bounds, int step, float inv_sigma_color2)
+	{
+		static float const kernel[5] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+		float const inv_sigma_normal2 = 1.f / (sigma_normal * sigma_normal);
+		float const inv_sigma_albedo2 = 1.f / (sigma_albedo * sigma_albedo);
+
+		int row_length = bounds.z - bounds.x;
+		std::vector<float> sum_r(row_length), sum_g(row_length), sum_b(row_length), weights(row_length);
+		std::vector<int> columns(row_length);
+
+		for (int y = bounds.y; y < bounds.w; ++y)
+		{
+			std::fill(sum_r.begin(), sum_r.end(), 0.f);
+			std::fill(sum_g.begin(), sum_g.end(), 0.f);
+			std::fill(sum_b.begin(), sum_b.end(), 0.f);
+			std::fill(weights.begin(), weights.end(), 0.f);
+			int center = y * width + bounds.x;
+
+			for (int dy = -2; dy <= 2; ++dy)
+			{
+				int qy = clamp(y + dy * step, 0, height - 1);
+				for (int dx = -2; dx <= 2; ++dx)
+				{
+					float h = kernel[dy + 2] * kernel[dx + 2];
+					for (int i = 0; i < row_length; ++i)
+					{
+						columns[i] = qy * width + clamp(bounds.x + i + dx * step, 0, width - 1);
+					}
+					float const* cr = color[0].data(); float const* cg = color[1].data(); float const* cb = color[2].data();
+					float const* nx = normal[0].data(); float const* ny = normal[1].data(); float const* nz = normal[2].data();
+					float const* ar = albedo[0].data(); float const* ag = albedo[1].data(); float const* ab = albedo[2].data();
+					int const* q = columns.data();
+					float* s_r = sum_r.data(); float* s_g = sum_g.data(); float* s_b = sum_b.data(); float* s_w = weights.data();
+					#pragma omp simd
+					for (int i = 0; i < row_length; ++i)
+					{
+						int p = center + i;
+						float d_r = cr[p] - cr[q[i]], d_g = cg[p] - cg[q[i]], d_b = cb[p] - cb[q[i]];
+						float d_nx = nx[p] - nx[q[i]], d_ny = ny[p] - ny[q[i]], d_nz = nz[p] - nz[q[i]];
+						float d_ar = ar[p] - ar[q[i]], d_ag = ag[p] - ag[q[i]], d_ab = ab[p] - ab[q[i]];
+						float distance = (d_r * d_r + d_g * d_g + d_b * d_b) * inv_sigma_color2
+							+ (d_nx * d_nx + d_ny * d_ny + d_nz * d_nz) * inv_sigma_normal2
+							+ (d_ar * d_ar + d_ag * d_ag + d_ab * d_ab) * inv_sigma_albedo2;
+						float w = h * std::exp(-distance);
+						s_r[i] += cr[q[i]] * w;
+						s_g[i] += cg[q[i]] * w;
+						s_b[i] += cb[q[i]] * w;
+						s_w[i] += w;
+					}
+				}
+			}
+
+			for (int i = 0; i < row_length; ++i)
+			{
+				//the center tap always has weight kernel[2]^2, so this never divides by zero
+				scratch[0][center + i] = sum_r[i] / weights[i];
+				scratch[1][center + i] = sum_g[i] / weights[i];
+				scratch[2][center + i] = sum_b[i] / weights[i];
+			}
+		}
+	}
+
+	//working buffers, planar per channel
+	int width{ 0 }, height{ 0 };
+	std::vector<float> color[3], scratch[3], normal[3], albedo[3];
+};
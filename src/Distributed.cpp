@@ -0,0 +1,494 @@
+#include "Distributed.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include <omp.h>
+
+#include "Kernels.h"
+#include "Renderer.h"
+#include "Socket.h"
+
+namespace distributed
+{
+	//bumped whenever a message changes
+	uint32_t const PROTOCOL_VERSION = 1;
+
+	enum Message : uint32_t
+	{
+		Job = 1,  //coordinator: protocol version, then the command line as zero terminated strings
+		Ready,    //worker: the Frame it is set up for
+		Request,  //worker: how many tiles it wants, and its rays traced so far
+		Tiles,    //coordinator: tile indices, none when the frame is done
+		Result,   //worker: tile index, then the FilmTile's pixels as RGBA floats
+	};
+
+	//what coordinator and workers have to agree on for the tiles to fit the film
+	struct Frame
+	{
+		int32_t width, height, tile_size, samples, filter;
+		float filter_radius;
+		int32_t region[4];
+	};
+
+	static Frame frame_of(RenderSettings const& settings)
+	{
+		Frame frame;
+		memset(&frame, 0, sizeof(frame));
+		frame.width = settings.width;
+		frame.height = settings.height;
+		frame.tile_size = settings.tile_size;
+		frame.samples = settings.samples;
+		frame.filter = int32_t(settings.filter);
+		frame.filter_radius = settings.filter_radius;
+		for (int i = 0; i < 4; ++i)
+		{
+			frame.region[i] = settings.region[i];
+		}
+		return frame;
+	}
+
+	template <typename T>
+	static void put(std::vector<char>& out, T const& value)
+	{
+		char const* p = reinterpret_cast<char const*>(&value);
+		out.insert(out.end(), p, p + sizeof(T));
+	}
+
+	template <typename T>
+	static bool get(std::vector<char> const& in, size_t& offset, T& value)
+	{
+		if (offset + sizeof(T) > in.size())
+		{
+			return false;
+		}
+		memcpy(&value, in.data() + offset, sizeof(T));
+		offset += sizeof(T);
+		return true;
+	}
+
+	typedef std::chrono::steady_clock clock;
+
+	struct Worker
+	{
+		net::Socket socket;
+		int id;
+		bool ready{ false };
+		int wanted{ 0 };            //tiles asked for and not given yet
+		std::vector<int> tiles;     //handed out, result outstanding
+		clock::time_point last_heard;
+		uint64_t rays{ 0 };
+	};
+
+	bool coordinate(RenderSettings const& settings, std::vector<std::string> const& args, Film& film, std::vector<TileWriter*> const& writers)
+	{
+		if (settings.aovs || settings.denoise)
+		{
+			std::cerr << "AOVs and denoising need a local render, not a coordinator" << std::endl;
+			return false;
+		}
+		net::Socket listener = net::listen(settings.coordinator);
+		if (!listener.Valid())
+		{
+			std::cerr << "Could not listen on " << settings.coordinator << std::endl;
+			return false;
+		}
+
+		ivec4 const region = rt::render_region(settings, film);
+		bool const stream_tiles = (film.Filter().Apron() == 0);
+		std::vector<bool> done(film.TileCount(), true);
+		std::deque<int> pending;
+		for (int tile = 0; tile < film.TileCount(); ++tile)
+		{
+			if (rt::region_tile(film, region, tile))
+			{
+				done[tile] = false;
+				pending.push_back(tile);
+			}
+			else if (stream_tiles)
+			{
+				for (TileWriter* writer : writers)
+				{
+					writer->WriteTile(film, tile);
+				}
+			}
+		}
+		size_t remaining = pending.size();
+
+		std::vector<char> job;
+		put(job, PROTOCOL_VERSION);
+		for (std::string const& arg : args)
+		{
+			job.insert(job.end(), arg.c_str(), arg.c_str() + arg.size() + 1);
+		}
+		Frame const frame = frame_of(settings);
+
+		std::vector<std::unique_ptr<Worker> > workers;
+		int next_id = 0, reissued = 0;
+		uint64_t lost_rays = 0;
+		auto drop = [&](size_t index, char const* reason)
+		{
+			Worker& worker = *workers[index];
+			int returned = 0;
+			for (int tile : worker.tiles)
+			{
+				if (!done[tile])
+				{
+					pending.push_front(tile);
+					++returned;
+				}
+			}
+			reissued += returned;
+			lost_rays += worker.rays;
+			std::cout << "worker " << worker.id << " " << reason << ", " << returned << " tiles handed out again" << std::endl;
+			workers.erase(workers.begin() + index);
+		};
+		//pending tiles first, then copies of ones other workers are still on
+		auto hand_out = [&](Worker& worker)
+		{
+			std::vector<char> message;
+			int count = 0;
+			while (count < worker.wanted && !pending.empty())
+			{
+				int tile = pending.front();
+				pending.pop_front();
+				if (!done[tile])
+				{
+					put(message, int32_t(tile));
+					worker.tiles.push_back(tile);
+					++count;
+				}
+			}
+			for (std::unique_ptr<Worker> const& other : workers)
+			{
+				for (int tile : other->tiles)
+				{
+					if (count < worker.wanted && !done[tile] && std::find(worker.tiles.begin(), worker.tiles.end(), tile) == worker.tiles.end())
+					{
+						put(message, int32_t(tile));
+						worker.tiles.push_back(tile);
+						++count;
+					}
+				}
+			}
+			if (count == 0)
+			{
+				return true;
+			}
+			worker.wanted = 0;
+			worker.last_heard = clock::now();
+			return worker.socket.Send(Tiles, message);
+		};
+
+		std::cout << "coordinator: " << remaining << " tiles, waiting for workers on " << settings.coordinator << std::endl;
+		std::vector<char> payload;
+		while (remaining > 0)
+		{
+			std::vector<pollfd> fds(workers.size() + 1);
+			fds[0].fd = listener.Native();
+			fds[0].events = POLLIN;
+			for (size_t i = 0; i < workers.size(); ++i)
+			{
+				fds[i + 1].fd = workers[i]->socket.Native();
+				fds[i + 1].events = POLLIN;
+			}
+			net::poll_handles(fds.data(), fds.size(), 1000);
+
+			//last first, so dropping a worker doesn't shift the ones still to look at
+			for (size_t i = workers.size(); i-- > 0;)
+			{
+				if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+				{
+					continue;
+				}
+				Worker& worker = *workers[i];
+				uint32_t type;
+				if (!worker.socket.Receive(type, payload))
+				{
+					drop(i, "disconnected");
+					continue;
+				}
+				worker.last_heard = clock::now();
+				size_t offset = 0;
+				bool ok = true;
+				if (type == Ready)
+				{
+					Frame worker_frame;
+					ok = get(payload, offset, worker_frame) && memcmp(&worker_frame, &frame, sizeof(Frame)) == 0;
+					if (!ok)
+					{
+						drop(i, "has a different image size, tile size, filter, region or sample count");
+						continue;
+					}
+					worker.ready = true;
+				}
+				else if (type == Request && worker.ready)
+				{
+					int32_t count;
+					ok = get(payload, offset, count) && get(payload, offset, worker.rays) && count > 0;
+					if (ok)
+					{
+						worker.wanted = count;
+						if (!hand_out(worker))
+						{
+							drop(i, "disconnected");
+							continue;
+						}
+					}
+				}
+				else if (type == Result && worker.ready)
+				{
+					int32_t tile;
+					ok = get(payload, offset, tile) && tile >= 0 && tile < film.TileCount();
+					if (ok)
+					{
+						worker.tiles.erase(std::remove(worker.tiles.begin(), worker.tiles.end(), int(tile)), worker.tiles.end());
+						FilmTile film_tile(film, tile, region);
+						ok = (payload.size() - offset == film_tile.pixels.size() * sizeof(vec4));
+						if (ok && !done[tile])
+						{
+							memcpy(film_tile.pixels.data(), payload.data() + offset, payload.size() - offset);
+							film.MergeTile(film_tile);
+							done[tile] = true;
+							--remaining;
+							if (stream_tiles)
+							{
+								for (TileWriter* writer : writers)
+								{
+									writer->WriteTile(film, tile);
+								}
+							}
+						}
+					}
+				}
+				else
+				{
+					ok = false;
+				}
+				if (!ok)
+				{
+					drop(i, "sent a bad message");
+				}
+			}
+
+			if (fds[0].revents & POLLIN)
+			{
+				net::Socket socket = listener.Accept();
+				if (socket.Valid())
+				{
+					//a message that starts arriving has to finish in time
+					socket.SetReceiveTimeout(60);
+					std::unique_ptr<Worker> worker(new Worker());
+					worker->socket = std::move(socket);
+					worker->id = next_id++;
+					worker->last_heard = clock::now();
+					if (worker->socket.Send(Job, job))
+					{
+						std::cout << "worker " << worker->id << " connected" << std::endl;
+						workers.push_back(std::move(worker));
+					}
+				}
+			}
+
+			clock::time_point now = clock::now();
+			for (size_t i = workers.size(); i-- > 0;)
+			{
+				Worker& worker = *workers[i];
+				if (!worker.tiles.empty() && settings.worker_timeout > 0 && now - worker.last_heard > std::chrono::seconds(settings.worker_timeout))
+				{
+					drop(i, "timed out");
+				}
+			}
+			//tiles that came back from dropped workers go to the ones waiting for work
+			for (size_t i = workers.size(); i-- > 0;)
+			{
+				if (workers[i]->wanted > 0 && !hand_out(*workers[i]))
+				{
+					drop(i, "disconnected");
+				}
+			}
+		}
+
+		uint64_t rays = lost_rays;
+		for (std::unique_ptr<Worker> const& worker : workers)
+		{
+			//workers still on copies of finished tiles find this after their next request
+			worker->socket.Send(Tiles, std::vector<char>());
+			rays += worker->rays;
+		}
+		if (!stream_tiles)
+		{
+			for (int tile = 0; tile < film.TileCount(); ++tile)
+			{
+				for (TileWriter* writer : writers)
+				{
+					writer->WriteTile(film, tile);
+				}
+			}
+		}
+		std::cout << "coordinator: " << next_id << " workers, " << reissued << " tiles handed out again, "
+			<< rays << " rays reported" << std::endl;
+		return true;
+	}
+
+	//the coordinator may still be starting
+	static net::Socket connect_retrying(std::string const& address, int seconds)
+	{
+		for (int attempt = 0; ; ++attempt)
+		{
+			net::Socket socket = net::connect(address);
+			if (socket.Valid() || attempt >= seconds)
+			{
+				return socket;
+			}
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+	}
+
+	//the coordinator's command line, then the worker's own, with machine specific settings only from the latter
+	static bool apply_arguments(RenderSettings& settings, std::vector<std::string> const& job_args, std::vector<std::string> const& args)
+	{
+		if (!config::parse_command_line(settings, job_args))
+		{
+			return false;
+		}
+		settings.threads = RenderSettings().threads;
+		settings.isa = RenderSettings().isa;
+		return config::parse_command_line(settings, args);
+	}
+
+	int work(std::string const& address, std::vector<std::string> const& args)
+	{
+		net::Socket socket = connect_retrying(address, 30);
+		if (!socket.Valid())
+		{
+			std::cerr << "Could not connect to coordinator " << address << std::endl;
+			return 1;
+		}
+		uint32_t type, version;
+		std::vector<char> payload;
+		size_t offset = 0;
+		if (!socket.Receive(type, payload) || type != Job || !get(payload, offset, version) || version != PROTOCOL_VERSION)
+		{
+			std::cerr << "Coordinator " << address << " speaks a different protocol" << std::endl;
+			return 1;
+		}
+		std::vector<std::string> job_args;
+		while (offset < payload.size())
+		{
+			//the last one may be missing its terminator
+			job_args.emplace_back(payload.data() + offset, strnlen(payload.data() + offset, payload.size() - offset));
+			offset += job_args.back().size() + 1;
+		}
+
+		rt::Renderer renderer;
+		RenderSettings& settings = renderer.Settings();
+		if (!apply_arguments(settings, job_args, args))
+		{
+			return 1;
+		}
+		if (!renderer.LoadScene())
+		{
+			return 1;
+		}
+		if (!renderer.World().settings.empty())
+		{
+			for (auto const& setting : renderer.World().settings)
+			{
+				if (!config::apply(settings, setting.first, setting.second))
+				{
+					return 1;
+				}
+			}
+			if (!apply_arguments(settings, job_args, args))
+			{
+				return 1;
+			}
+		}
+		if (settings.threads > 0)
+		{
+			omp_set_num_threads(settings.threads);
+		}
+		renderer.ResetStats();
+		kernels::select(settings.isa);
+		renderer.Build();
+		if (!renderer.LoadEnvironment(settings.environment))
+		{
+			return 1;
+		}
+		std::vector<char> ready;
+		put(ready, frame_of(settings));
+		if (!socket.Send(Ready, ready))
+		{
+			return 1;
+		}
+		std::cout << "worker: connected to " << address << ", " << cpu::name(kernels::active().isa) << " kernels, "
+			<< omp_get_max_threads() << " threads" << std::endl;
+
+		//only the tile bounds and filter are used, but those need the whole film
+		Film film(settings.width, settings.height, settings.tile_size, FilterTable(settings.filter, settings.filter_radius));
+		ivec4 const region = rt::render_region(settings, film);
+		int tiles_rendered = 0;
+		while (true)
+		{
+			std::vector<char> request;
+			put(request, int32_t(omp_get_max_threads()));
+			put(request, uint64_t(renderer.Rays().Total()));
+			if (!socket.Send(Request, request) || !socket.Receive(type, payload) || type != Tiles)
+			{
+				//also what happens when the frame got done with the copy of a tile this worker was on
+				std::cout << "worker: the coordinator closed the connection" << std::endl;
+				break;
+			}
+			if (payload.empty())
+			{
+				break;
+			}
+			std::vector<int32_t> tiles(payload.size() / sizeof(int32_t));
+			memcpy(tiles.data(), payload.data(), tiles.size() * sizeof(int32_t));
+			bool valid = payload.size() % sizeof(int32_t) == 0;
+			for (int32_t tile : tiles)
+			{
+				valid = valid && tile >= 0 && tile < film.TileCount();
+			}
+			if (!valid)
+			{
+				std::cerr << "worker: the coordinator sent a bad tile list" << std::endl;
+				return 1;
+			}
+			//workers would otherwise all start from the same random sequence
+			srand(unsigned(settings.seed) + unsigned(tiles.front()) * 7919u);
+			std::vector<FilmTile> film_tiles;
+			film_tiles.reserve(tiles.size());
+			for (int32_t tile : tiles)
+			{
+				film_tiles.emplace_back(film, tile, region);
+			}
+			#pragma omp parallel for schedule(dynamic)
+			for (int k = 0; k < int(tiles.size()); ++k)
+			{
+				renderer.RenderTile(film, tiles[k], film_tiles[k]);
+			}
+			for (size_t k = 0; k < tiles.size(); ++k)
+			{
+				std::vector<char> result;
+				result.reserve(sizeof(int32_t) + film_tiles[k].pixels.size() * sizeof(vec4));
+				put(result, tiles[k]);
+				char const* pixels = reinterpret_cast<char const*>(film_tiles[k].pixels.data());
+				result.insert(result.end(), pixels, pixels + film_tiles[k].pixels.size() * sizeof(vec4));
+				if (!socket.Send(Result, result))
+				{
+					break;
+				}
+			}
+			tiles_rendered += int(tiles.size());
+		}
+		std::cout << "worker: " << tiles_rendered << " tiles, " << renderer.Rays().Total() << " rays" << std::endl;
+		return 0;
+	}
+}
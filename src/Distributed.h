@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Config.h"
+#include "Film.h"
+#include "ImageWriter.h"
+
+//One frame rendered by several processes, on one machine or many.
+//The coordinator (rt --coordinator host:port) listens for workers (rt --worker host:port) and sends each
+//its own command line, so workers load the same scene and settings; paths in it have to be valid on the
+//workers too. A worker's own options are applied last, for machine specific ones like threads and isa.
+//Workers ask for as many tiles as they have threads and send back the float FilmTiles, splats into
+//neighbouring tiles included, which the coordinator merges into its film and hands to the writers.
+//Tiles of a worker that disconnects or goes quiet for settings.worker_timeout are handed out again,
+//and once all tiles are out, idle workers get copies of the outstanding ones; the first result wins.
+namespace distributed
+{
+	//Renders the tiles of settings.region with whatever workers connect to settings.coordinator.
+	//args is the command line sent to the workers, program name first. Returns false if the
+	//address can't be listened on or the settings can't be rendered this way.
+	bool coordinate(RenderSettings const& settings, std::vector<std::string> const& args, Film& film, std::vector<TileWriter*> const& writers);
+
+	//Connects to the coordinator at address and renders the tiles it hands out until it has all of them.
+	//args is the worker's own command line, applied over the coordinator's. Returns the exit code.
+	int work(std::string const& address, std::vector<std::string> const& args);
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+#include <3rdparty/glm/gtc/constants.hpp>
+#include <3rdparty/stb_image.h>
+
+#include "rt_math.h"
+
+using namespace glm;
+
+//Piecewise-constant 1D distribution over [0,1).
+//Bins are picked through an alias table, so sampling is O(1) regardless of resolution.
+class Distribution1D
+{
+public:
+	Distribution1D() {}
+	Distribution1D(float const* f, int n) : func(f, f + n), prob(n), alias(n)
+	{
+		float sum = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			sum += func[i];
+		}
+		integral = sum / n;
+
+		//Vose's method: split the bins in under- and over-full ones and pair them up
+		std::vector<float> scaled(n);
+		std::vector<int> small, large;
+		for (int i = 0; i < n; ++i)
+		{
+			scaled[i] = (sum > 0) ? func[i] * n / sum : 1.f;
+			(scaled[i] < 1.f ? small : large).push_back(i);
+		}
+		while (!small.empty() && !large.empty())
+		{
+			int s = small.back(); small.pop_back();
+			int l = large.back(); large.pop_back();
+			prob[s] = scaled[s];
+			alias[s] = l;
+			scaled[l] = (scaled[l] + scaled[s]) - 1.f;
+			(scaled[l] < 1.f ? small : large).push_back(l);
+		}
+		//leftovers are full up to rounding
+		for (int i : large) { prob[i] = 1.f; alias[i] = i; }
+		for (int i : small) { prob[i] = 1.f; alias[i] = i; }
+	}
+
+	//returns a point in [0,1) and its density
+	float Sample(float u, float& pdf, int& bin) const
+	{
+		int n = Count();
+		float scaled = u * n;
+		bin = glm::min(int(scaled), n - 1);
+		float remapped = scaled - bin;
+		if (remapped < prob[bin])
+		{
+			remapped /= prob[bin];
+		}
+		else
+		{
+			remapped = (remapped - prob[bin]) / (1.f - prob[bin]);
+			bin = alias[bin];
+		}
+		pdf = Pdf(bin);
+		return glm::min((bin + remapped) / n, 1.f - FLT_EPSILON);
+	}
+
+	float Pdf(int bin) const
+	{
+		return (integral > 0) ? func[bin] / integral : 0.f;
+	}
+
+	int Count() const
+	{
+		return int(func.size());
+	}
+
+	std::vector<float> func;
+	float integral{ 0 };
+
+private:
+	std::vector<float> prob;
+	std::vector<int> alias;
+};
+
+//Marginal distribution over rows and one conditional distribution per row
+class Distribution2D
+{
+public:
+	Distribution2D() {}
+	Distribution2D(float const* f, int width, int height)
+	{
+		conditional.reserve(height);
+		std::vector<float> row_integrals(height);
+		for (int v = 0; v < height; ++v)
+		{
+			conditional.emplace_back(f + v * width, width);
+			row_integrals[v] = conditional.back().integral;
+		}
+		marginal = Distribution1D(row_integrals.data(), height);
+	}
+
+	vec2 Sample(vec2 const& u, float& pdf) const
+	{
+		float pdf_v, pdf_u;
+		int v, u_bin;
+		float y = marginal.Sample(u.y, pdf_v, v);
+		float x = conditional[v].Sample(u.x, pdf_u, u_bin);
+		pdf = pdf_u * pdf_v;
+		return vec2(x, y);
+	}
+
+	float Pdf(vec2 const& uv) const
+	{
+		int v = clamp(int(uv.y * marginal.Count()), 0, marginal.Count() - 1);
+		int u = clamp(int(uv.x * conditional[v].Count()), 0, conditional[v].Count() - 1);
+		return (marginal.integral > 0) ? conditional[v].func[u] / marginal.integral : 0.f;
+	}
+
+private:
+	std::vector<Distribution1D> conditional;
+	Distribution1D marginal;
+};
+
+//HDR lat-long sky, +y is up
+class EnvironmentMap
+{
+public:
+
+	bool Load(char const* path)
+	{
+		int channels;
+		float* data = stbi_loadf(path, &width, &height, &channels, 3);
+		if (!data)
+		{
+			std::cerr << "Could not load environment map " << path << ": " << stbi_failure_reason() << std::endl;
+			return false;
+		}
+		texels.resize(width * height);
+		for (int i = 0; i < width * height; ++i)
+		{
+			texels[i] = vec3(data[i * 3 + 0], data[i * 3 + 1], data[i * 3 + 2]);
+		}
+		stbi_image_free(data);
+
+		//weight by sin(theta) so the poles, which are stretched over a whole row, aren't oversampled
+		std::vector<float> importance(width * height);
+		for (int y = 0; y < height; ++y)
+		{
+			float sin_theta = sin(pi<float>() * (y + 0.5f) / height);
+			for (int x = 0; x < width; ++x)
+			{
+				importance[y * width + x] = luminance(texels[y * width + x]) * sin_theta;
+			}
+		}
+		distribution = Distribution2D(importance.data(), width, height);
+		return true;
+	}
+
+	bool Loaded() const
+	{
+		return !texels.empty();
+	}
+
+	vec3 Lookup(vec3 const& direction) const
+	{
+		vec2 uv = DirectionToUV(normalize(direction));
+		int x = clamp(int(uv.x * width), 0, width - 1);
+		int y = clamp(int(uv.y * height), 0, height - 1);
+		return texels[y * width + x];
+	}
+
+	//importance-samples a direction towards the sky, pdf is per unit solid angle
+	vec3 Sample(vec2 const& u, vec3& direction, float& pdf) const
+	{
+		float pdf_uv;
+		vec2 uv = distribution.Sample(u, pdf_uv);
+		float theta = uv.y * pi<float>();
+		float sin_theta = sin(theta);
+		if (pdf_uv == 0 || sin_theta == 0)
+		{
+			pdf = 0;
+			return vec3(0);
+		}
+		direction = UVToDirection(uv);
+		pdf = pdf_uv / (2.f * pi<float>() * pi<float>() * sin_theta);
+		return Lookup(direction);
+	}
+
+	float Pdf(vec3 const& direction) const
+	{
+		vec2 uv = DirectionToUV(normalize(direction));
+		float sin_theta = sin(uv.y * pi<float>());
+		if (sin_theta == 0)
+		{
+			return 0;
+		}
+		return distribution.Pdf(uv) / (2.f * pi<float>() * pi<float>() * sin_theta);
+	}
+
+private:
+
+	static vec2 DirectionToUV(vec3 const& d)
+	{
+		float phi = atan2(d.z, d.x);
+		if (phi < 0)
+		{
+			phi += two_pi<float>();
+		}
+		float theta = acos(clamp(d.y, -1.f, 1.f));
+		return vec2(phi * one_over_two_pi<float>(), theta * one_over_pi<float>());
+	}
+
+	static vec3 UVToDirection(vec2 const& uv)
+	{
+		float phi = uv.x * two_pi<float>();
+		float theta = uv.y * pi<float>();
+		return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+	}
+
+	int width{ 0 }, height{ 0 };
+	std::vector<vec3> texels;
+	Distribution2D distribution;
+};
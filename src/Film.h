@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "Filter.h"
+#include "Kernels.h"
+
+using namespace glm;
+
+int const CACHE_LINE_SIZE = 64;
+int const DEFAULT_TILE_SIZE = 16;
+
+class FilmTile;
+
+//Float RGBA accumulation buffer. RGB holds the weighted sum of samples, alpha the sum of weights,
+//so rendering more passes into the same film refines it progressively.
+//Samples are splatted through the reconstruction filter into FilmTiles, which are merged in afterwards.
+//Pixels are stored tile by tile, every tile starting on its own cache line, so threads working
+//on different tiles never write to the same line.
+class Film
+{
+public:
+	Film(int width, int height, int tile_size = DEFAULT_TILE_SIZE, FilterTable const& filter = FilterTable()) :
+		//an even tile size keeps every tile a whole number of cache lines
+		width(width), height(height), tile_size((tile_size + 1) & ~1), filter(filter)
+	{
+		tiles_x = (width + this->tile_size - 1) / this->tile_size;
+		tiles_y = (height + this->tile_size - 1) / this->tile_size;
+		//edge tiles are padded to full size so all tiles have the same stride
+		size_t floats = size_t(TileCount()) * TileStride();
+		storage.resize(floats + CACHE_LINE_SIZE / sizeof(float));
+		uintptr_t address = reinterpret_cast<uintptr_t>(storage.data());
+		size_t misalignment = address % CACHE_LINE_SIZE;
+		data = storage.data() + (misalignment ? (CACHE_LINE_SIZE - misalignment) / sizeof(float) : 0);
+	}
+
+	Film(Film const&) = delete;
+	Film& operator=(Film const&) = delete;
+
+	int Width() const { return width; }
+	int Height() const { return height; }
+	int TileSize() const { return tile_size; }
+	int TilesX() const { return tiles_x; }
+	int TilesY() const { return tiles_y; }
+	int TileCount() const { return tiles_x * tiles_y; }
+
+	//pixel rectangle covered by a tile, as (min, max) with max exclusive
+	ivec4 TileBounds(int tile) const
+	{
+		ivec2 min_corner = ivec2(tile % tiles_x, tile / tiles_x) * tile_size;
+		ivec2 max_corner = glm::min(min_corner + tile_size, ivec2(width, height));
+		return ivec4(min_corner, max_corner);
+	}
+
+	void Add(ivec2 const& pos, vec3 const& color, float weight = 1.f)
+	{
+		float* p = Texel(pos);
+		p[0] += color.r * weight;
+		p[1] += color.g * weight;
+		p[2] += color.b * weight;
+		p[3] += weight;
+	}
+
+	//a weighted sum and its weight as they are, from another film
+	void AddSum(ivec2 const& pos, vec4 const& sum)
+	{
+		float* p = Texel(pos);
+		p[0] += sum.r;
+		p[1] += sum.g;
+		p[2] += sum.b;
+		p[3] += sum.a;
+	}
+
+	vec4 Get(ivec2 const& pos) const
+	{
+		float const* p = Texel(pos);
+		return vec4(p[0], p[1], p[2], p[3]);
+	}
+
+	//normalized color of a pixel
+	vec3 Resolve(ivec2 const& pos) const
+	{
+		vec4 p = Get(pos);
+		return (p.a > 0) ? vec3(p) / p.a : vec3(0);
+	}
+
+	FilterTable const& Filter() const
+	{
+		return filter;
+	}
+
+	//Groups of tiles that can be rendered and merged concurrently: a tile's splats reach
+	//ceil(apron / tile size) tiles to each side, so tiles twice that plus one apart never touch
+	//the same pixels. Without an apron all tiles are independent.
+	std::vector<std::vector<int> > IndependentTileSets() const
+	{
+		int reach = (filter.Apron() + tile_size - 1) / tile_size;
+		int stride = 2 * reach + 1;
+		std::vector<std::vector<int> > sets(stride * stride);
+		for (int tile = 0; tile < TileCount(); ++tile)
+		{
+			int tx = tile % tiles_x, ty = tile / tiles_x;
+			sets[(ty % stride) * stride + tx % stride].push_back(tile);
+		}
+		return sets;
+	}
+
+	inline void MergeTile(FilmTile const& film_tile);
+
+	void Clear()
+	{
+		std::fill(storage.begin(), storage.end(), 0.f);
+	}
+
+	//Gamma-2 8-bit RGB conversion into a row-major image, kept separate from rendering
+	//so it runs as one tight pass over each tile, with the widest kernel the processor has.
+	void ToRGB8(unsigned char* img) const
+	{
+		kernels::Table const& k = kernels::active();
+		#pragma omp parallel for schedule(static)
+		for (int tile = 0; tile < TileCount(); ++tile)
+		{
+			ivec4 bounds = TileBounds(tile);
+			int row_length = bounds.z - bounds.x;
+			for (int y = bounds.y; y < bounds.w; ++y)
+			{
+				float const* src = Texel(ivec2(bounds.x, y));
+				unsigned char* dst = img + (size_t(y) * width + bounds.x) * 3;
+				k.resolve_rgb8(src, row_length, dst);
+			}
+		}
+	}
+
+private:
+
+	size_t TileStride() const
+	{
+		return size_t(tile_size) * tile_size * 4;
+	}
+
+	size_t Offset(ivec2 const& pos) const
+	{
+		int tile = (pos.y / tile_size) * tiles_x + pos.x / tile_size;
+		ivec2 local = pos % tile_size;
+		return tile * TileStride() + (size_t(local.y) * tile_size + local.x) * 4;
+	}
+
+	float* Texel(ivec2 const& pos) { return data + Offset(pos); }
+	float const* Texel(ivec2 const& pos) const { return data + Offset(pos); }
+
+	int width, height, tile_size;
+	int tiles_x, tiles_y;
+	FilterTable filter;
+	std::vector<float> storage;
+	float* data;
+};
+
+//Tile-local accumulation: a tile's samples, including the apron they reach into
+//neighbouring tiles, are splatted here without touching the shared film.
+class FilmTile
+{
+public:
+	FilmTile(Film const& film, int tile) : FilmTile(film, tile, ivec4(0, 0, film.Width(), film.Height()))
+	{
+	}
+
+	//only keeps what lands inside region, (min, max) with max exclusive, so merging leaves the rest of the film alone
+	FilmTile(Film const& film, int tile, ivec4 const& region) : filter(film.Filter())
+	{
+		int apron = filter.Apron();
+		ivec4 tile_bounds = film.TileBounds(tile);
+		ivec2 min_corner = glm::max(ivec2(tile_bounds.x, tile_bounds.y) - apron, ivec2(region.x, region.y));
+		ivec2 max_corner = glm::min(ivec2(tile_bounds.z, tile_bounds.w) + apron, ivec2(region.z, region.w));
+		bounds = ivec4(min_corner, glm::max(max_corner, min_corner));
+		pixels.assign((bounds.z - bounds.x) * (bounds.w - bounds.y), vec4(0));
+	}
+
+	//film_pos is continuous, pixel (x, y) covers [x, x+1) x [y, y+1)
+	void AddSample(vec2 const& film_pos, vec3 const& color)
+	{
+		float radius = filter.Radius();
+		//pixels whose centers are within the filter radius
+		ivec2 p0 = glm::max(ivec2(ceil(film_pos - 0.5f - radius)), ivec2(bounds.x, bounds.y));
+		ivec2 p1 = glm::min(ivec2(floor(film_pos - 0.5f + radius)), ivec2(bounds.z, bounds.w) - 1);
+		int row_length = bounds.z - bounds.x;
+		for (int y = p0.y; y <= p1.y; ++y)
+		{
+			for (int x = p0.x; x <= p1.x; ++x)
+			{
+				float weight = filter.Weight(vec2(x + 0.5f, y + 0.5f) - film_pos);
+				pixels[(y - bounds.y) * row_length + (x - bounds.x)] += vec4(color * weight, weight);
+			}
+		}
+	}
+
+	//(min, max) pixel rectangle, max exclusive
+	ivec4 bounds;
+	std::vector<vec4> pixels;
+
+private:
+	FilterTable const& filter;
+};
+
+void Film::MergeTile(FilmTile const& film_tile)
+{
+	ivec4 const& bounds = film_tile.bounds;
+	int row_length = bounds.z - bounds.x;
+	for (int y = bounds.y; y < bounds.w; ++y)
+	{
+		for (int x = bounds.x; x < bounds.z; ++x)
+		{
+			vec4 const& p = film_tile.pixels[(y - bounds.y) * row_length + (x - bounds.x)];
+			float* texel = Texel(ivec2(x, y));
+			texel[0] += p.r;
+			texel[1] += p.g;
+			texel[2] += p.b;
+			texel[3] += p.a;
+		}
+	}
+}
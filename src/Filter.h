@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+#include <3rdparty/glm/gtc/constants.hpp>
+
+using namespace glm;
+
+enum class FilterType
+{
+	Box,
+	Gaussian,
+	Mitchell,
+	BlackmanHarris
+};
+
+//Pixel reconstruction filter, tabulated once so splatting a sample is just table lookups.
+//All supported filters are separable, so one 1D table over [0, radius] covers both axes.
+class FilterTable
+{
+public:
+	FilterTable(FilterType type = FilterType::Box, float radius = 0.5f) : type(type), radius(radius)
+	{
+		table.resize(TABLE_SIZE);
+		for (int i = 0; i < TABLE_SIZE; ++i)
+		{
+			table[i] = Evaluate((i + 0.5f) * radius / TABLE_SIZE);
+		}
+	}
+
+	//weight of a sample at offset d from a pixel center
+	float Weight(vec2 const& d) const
+	{
+		return Weight1D(d.x) * Weight1D(d.y);
+	}
+
+	float Radius() const
+	{
+		return radius;
+	}
+
+	//how many pixels a sample can reach beyond the pixel it was taken in
+	int Apron() const
+	{
+		return int(ceil(radius - 0.5f));
+	}
+
+	FilterType Type() const
+	{
+		return type;
+	}
+
+private:
+
+	static int const TABLE_SIZE = 64;
+
+	float Weight1D(float d) const
+	{
+		int i = int(abs(d) * (TABLE_SIZE / radius));
+		return (i < TABLE_SIZE) ? table[i] : 0.f;
+	}
+
+	float Evaluate(float x) const
+	{
+		switch (type)
+		{
+		case FilterType::Gaussian:
+		{
+			float const alpha = 2.f;
+			return glm::max(0.f, exp(-alpha * x * x) - exp(-alpha * radius * radius));
+		}
+		case FilterType::Mitchell:
+		{
+			//B = C = 1/3, defined over [-2, 2]
+			float const B = 1.f / 3, C = 1.f / 3;
+			float t = abs(2.f * x / radius);
+			if (t > 1)
+			{
+				return ((-B - 6 * C) * t * t * t + (6 * B + 30 * C) * t * t + (-12 * B - 48 * C) * t + (8 * B + 24 * C)) / 6.f;
+			}
+			return ((12 - 9 * B - 6 * C) * t * t * t + (-18 + 12 * B + 6 * C) * t * t + (6 - 2 * B)) / 6.f;
+		}
+		case FilterType::BlackmanHarris:
+		{
+			float n = (x / radius + 1.f) * 0.5f;
+			float const a0 = 0.35875f, a1 = 0.48829f, a2 = 0.14128f, a3 = 0.01168f;
+			return a0 - a1 * cos(two_pi<float>() * n) + a2 * cos(2 * two_pi<float>() * n) - a3 * cos(3 * two_pi<float>() * n);
+		}
+		case FilterType::Box:
+		default:
+			return 1.f;
+		}
+	}
+
+	FilterType type;
+	float radius;
+	std::vector<float> table;
+};
@@ -0,0 +1,373 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "ArrayView.h"
+#include "ray.h"
+#include "geometry.h"
+#include "Stats.h"
+
+using namespace glm;
+
+namespace geometry
+{
+	//32 bytes, two nodes per cache line
+	struct FlatBVHNode
+	{
+		vec3 min;
+		uint32_t offset; //first primitive for leaves, second child for inner nodes (the first one follows its parent)
+		vec3 max;
+		uint16_t count; //primitives in a leaf, 0 for inner nodes
+		uint16_t axis; //split axis, used to visit the nearer child first
+	};
+
+	//node bounds at shutter close, next to FlatBVHNode's at shutter open, only for scenes with motion
+	struct FlatBVHMotion
+	{
+		vec3 min;
+		float pad0;
+		vec3 max;
+		float pad1;
+	};
+
+	//BVH over primitive indices, stored as one array of nodes in depth-first order.
+	//Unlike BVHNode it doesn't own or know the primitives: the caller intersects them by index,
+	//so large scenes are one allocation for the nodes and one for the index order.
+	//Both arrays are plain data and can also be attached from a scene cache as they are.
+	//With moving primitives every node also has bounds at shutter close, and traversal
+	//interpolates between the two at the ray's time.
+	class FlatBVH
+	{
+	public:
+		static int const MAX_LEAF_SIZE = 4;
+		//traversal keeps one pending node per level, so trees can't be deeper than this
+		static int const MAX_DEPTH = 64;
+		//below this SAH gives way to median splits, which halve the count and so need at most 31 more levels
+		static int const MAX_SAH_DEPTH = 32;
+
+		//bounds_at_close, if given, are the primitives' bounds at time 1 and primitive_bounds those at time 0
+		void Build(std::vector<AABB> const& primitive_bounds, BVHBuild build, std::vector<AABB> const* bounds_at_close = nullptr)
+		{
+			node_storage.clear();
+			motion_storage.clear();
+			close_bounds = bounds_at_close;
+			//moving primitives are split by where they are over the whole shutter
+			std::vector<AABB> swept;
+			if (close_bounds)
+			{
+				swept.resize(primitive_bounds.size());
+				for (size_t i = 0; i < primitive_bounds.size(); ++i)
+				{
+					swept[i] = primitive_bounds[i].Union((*close_bounds)[i]);
+				}
+			}
+			std::vector<AABB> const& split_bounds = close_bounds ? swept : primitive_bounds;
+
+			index_storage.resize(primitive_bounds.size());
+			centroids.resize(primitive_bounds.size());
+			for (size_t i = 0; i < primitive_bounds.size(); ++i)
+			{
+				index_storage[i] = uint32_t(i);
+				centroids[i] = split_bounds[i].Center();
+			}
+			if (!index_storage.empty())
+			{
+				node_storage.reserve(2 * index_storage.size() / MAX_LEAF_SIZE + 1);
+				BuildRecursive(split_bounds, 0, uint32_t(index_storage.size()), 0, build);
+			}
+			centroids.clear();
+			centroids.shrink_to_fit();
+
+			//split_bounds gave the nodes swept bounds, narrow them down to the two shutter ends
+			if (close_bounds)
+			{
+				motion_storage.resize(node_storage.size());
+				RefitMotion(primitive_bounds, 0);
+			}
+			close_bounds = nullptr;
+			nodes = node_storage;
+			indices = index_storage;
+			motion = motion_storage;
+		}
+
+		//uses nodes and indices built earlier, which have to outlive the BVH
+		void Attach(ArrayView<FlatBVHNode> const& built_nodes, ArrayView<uint32_t> const& built_indices, ArrayView<FlatBVHMotion> const& built_motion = ArrayView<FlatBVHMotion>())
+		{
+			node_storage.clear();
+			index_storage.clear();
+			motion_storage.clear();
+			nodes = built_nodes;
+			indices = built_indices;
+			motion = built_motion;
+		}
+
+		//intersect(offset, count, ray, t_range, rec) is called per leaf with its range of indices,
+		//and must return true and write rec for the nearest of its primitives hit within t_range
+		template <typename IntersectLeaf>
+		bool Intersect(Ray const& ray, vec2 t_range, HitRecord& rec, IntersectLeaf const& intersect) const
+		{
+			if (nodes.empty())
+			{
+				return false;
+			}
+			vec3 inv_dir = 1.f / ray.direction;
+			ivec3 dir_is_negative = ivec3(inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0);
+			bool hit = false;
+			bool moving = !motion.empty();
+
+			uint32_t stack[MAX_DEPTH];
+			int stack_size = 0;
+			uint32_t current = 0;
+			while (true)
+			{
+				FlatBVHNode const& node = nodes[current];
+				STAT_ADD(BoxTests);
+				bool overlaps = moving ?
+					IntersectBox(mix(node.min, motion[current].min, ray.time), mix(node.max, motion[current].max, ray.time), ray.origin, inv_dir, t_range) :
+					IntersectBox(node.min, node.max, ray.origin, inv_dir, t_range);
+				if (overlaps)
+				{
+					STAT_ADD(NodeVisits);
+					if (node.count > 0)
+					{
+						if (intersect(node.offset, node.count, ray, t_range, rec))
+						{
+							t_range.y = rec.t;
+							hit = true;
+						}
+					}
+					else
+					{
+						//visit the child on the ray's side of the split first
+						if (dir_is_negative[node.axis])
+						{
+							stack[stack_size++] = current + 1;
+							current = node.offset;
+						}
+						else
+						{
+							stack[stack_size++] = node.offset;
+							current = current + 1;
+						}
+						continue;
+					}
+				}
+				if (stack_size == 0)
+				{
+					break;
+				}
+				current = stack[--stack_size];
+			}
+			return hit;
+		}
+
+		//Whether nodes and indices from elsewhere (a scene cache) are a tree Intersect can walk:
+		//children after their parent and within the nodes, leaves within the indices, indices below
+		//primitive_count and no deeper than MAX_DEPTH.
+		static bool Valid(ArrayView<FlatBVHNode> const& nodes, ArrayView<uint32_t> const& indices, size_t primitive_count)
+		{
+			for (uint32_t index : indices)
+			{
+				if (index >= primitive_count)
+				{
+					return false;
+				}
+			}
+			//children always come after their parent, so one pass in order sees every parent first
+			std::vector<uint8_t> depths(nodes.size(), 0);
+			for (size_t i = 0; i < nodes.size(); ++i)
+			{
+				FlatBVHNode const& node = nodes[i];
+				if (node.count > 0)
+				{
+					if (uint64_t(node.offset) + node.count > indices.size())
+					{
+						return false;
+					}
+					continue;
+				}
+				if (node.axis > 2 || i + 1 >= nodes.size() || node.offset <= i + 1 || node.offset >= nodes.size() ||
+					depths[i] + 1 >= MAX_DEPTH)
+				{
+					return false;
+				}
+				uint8_t depth = uint8_t(depths[i] + 1);
+				depths[i + 1] = glm::max(depths[i + 1], depth);
+				depths[node.offset] = glm::max(depths[node.offset], depth);
+			}
+			return true;
+		}
+
+		AABB Bounds() const
+		{
+			return nodes.empty() ? AABB(vec3(0), vec3(0)) : AABB(nodes[0].min, nodes[0].max);
+		}
+
+		ArrayView<FlatBVHNode> nodes;
+		//primitive order referenced by the leaves
+		ArrayView<uint32_t> indices;
+		//empty for static scenes
+		ArrayView<FlatBVHMotion> motion;
+
+	private:
+
+		static bool IntersectBox(vec3 const& min, vec3 const& max, vec3 const& origin, vec3 const& inv_dir, vec2 const& t_range)
+		{
+			vec3 t0 = (min - origin) * inv_dir;
+			vec3 t1 = (max - origin) * inv_dir;
+			vec3 t_near = glm::min(t0, t1);
+			vec3 t_far = glm::max(t0, t1);
+			float t_enter = glm::max(glm::max(t_near.x, t_near.y), glm::max(t_near.z, t_range.x));
+			float t_exit = glm::min(glm::min(t_far.x, t_far.y), glm::min(t_far.z, t_range.y));
+			return t_enter <= t_exit;
+		}
+
+		uint32_t BuildRecursive(std::vector<AABB> const& primitive_bounds, uint32_t begin, uint32_t end, uint depth, BVHBuild build)
+		{
+			uint32_t index = uint32_t(node_storage.size());
+			node_storage.emplace_back();
+
+			AABB bounds = primitive_bounds[index_storage[begin]];
+			vec3 c_min = centroids[index_storage[begin]], c_max = c_min;
+			for (uint32_t i = begin + 1; i < end; ++i)
+			{
+				bounds = bounds.Union(primitive_bounds[index_storage[i]]);
+				c_min = glm::min(c_min, centroids[index_storage[i]]);
+				c_max = glm::max(c_max, centroids[index_storage[i]]);
+			}
+			node_storage[index].min = bounds.min__;
+			node_storage[index].max = bounds.max__;
+
+			vec3 extent = c_max - c_min;
+			int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : ((extent.y > extent.z) ? 1 : 2);
+			uint32_t count = end - begin;
+			if (count <= uint32_t(MAX_LEAF_SIZE) || extent[axis] <= 0)
+			{
+				if (count <= 0xffff)
+				{
+					node_storage[index].offset = begin;
+					node_storage[index].count = uint16_t(count);
+					return index;
+				}
+				//too many coincident centroids for one leaf, split them arbitrarily
+				axis = 0;
+			}
+
+			//Median splits halve the count, so below MAX_SAH_DEPTH at most 31 more levels of inner nodes
+			//follow and the tree stays within MAX_DEPTH. Non-finite extents can't be binned.
+			bool sah = build == BVHBuild::SAH && depth < uint(MAX_SAH_DEPTH) && std::isfinite(extent[axis]);
+			uint32_t mid = begin + count / 2;
+			if (sah && extent[axis] > 0)
+			{
+				mid = SAHPartition(primitive_bounds, begin, end, axis, c_min[axis], extent[axis]);
+			}
+			if (!sah || mid == begin || mid == end)
+			{
+				mid = begin + count / 2;
+				std::nth_element(index_storage.begin() + begin, index_storage.begin() + mid, index_storage.begin() + end,
+					[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+			}
+
+			BuildRecursive(primitive_bounds, begin, mid, depth + 1, build);
+			uint32_t right = BuildRecursive(primitive_bounds, mid, end, depth + 1, build);
+			node_storage[index].offset = right;
+			node_storage[index].count = 0;
+			node_storage[index].axis = uint16_t(axis);
+			return index;
+		}
+
+		//Sets node bounds to the primitives' at time 0 and their motion bounds to those at time 1.
+		//Bounds that move linearly between the two contain everything in between.
+		void RefitMotion(std::vector<AABB> const& open_bounds, uint32_t index)
+		{
+			FlatBVHNode& node = node_storage[index];
+			AABB open, close;
+			if (node.count > 0)
+			{
+				open = open_bounds[index_storage[node.offset]];
+				close = (*close_bounds)[index_storage[node.offset]];
+				for (uint32_t i = node.offset + 1; i < node.offset + node.count; ++i)
+				{
+					open = open.Union(open_bounds[index_storage[i]]);
+					close = close.Union((*close_bounds)[index_storage[i]]);
+				}
+			}
+			else
+			{
+				RefitMotion(open_bounds, index + 1);
+				RefitMotion(open_bounds, node.offset);
+				open = AABB(node_storage[index + 1].min, node_storage[index + 1].max).Union(AABB(node_storage[node.offset].min, node_storage[node.offset].max));
+				close = AABB(motion_storage[index + 1].min, motion_storage[index + 1].max).Union(AABB(motion_storage[node.offset].min, motion_storage[node.offset].max));
+			}
+			node.min = open.min__;
+			node.max = open.max__;
+			motion_storage[index] = FlatBVHMotion{ close.min__, 0.f, close.max__, 0.f };
+		}
+
+		//same binned SAH as BVHNode, on centroids along the given axis
+		uint32_t SAHPartition(std::vector<AABB> const& primitive_bounds, uint32_t begin, uint32_t end, int axis, float c_min, float extent)
+		{
+			int const BINS = 12;
+			auto bin_of = [&](uint32_t primitive) -> int
+			{
+				//NaN fails the comparison and lands in the first bin
+				float bin = (centroids[primitive][axis] - c_min) / extent * BINS;
+				return (bin > 0) ? int(glm::min(bin, float(BINS - 1))) : 0;
+			};
+
+			AABB bin_bounds[BINS];
+			int counts[BINS] = { 0 };
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				int b = bin_of(index_storage[i]);
+				bin_bounds[b] = counts[b] ? bin_bounds[b].Union(primitive_bounds[index_storage[i]]) : primitive_bounds[index_storage[i]];
+				++counts[b];
+			}
+
+			float right_cost[BINS];
+			AABB accumulated;
+			int count = 0;
+			for (int b = BINS - 1; b > 0; --b)
+			{
+				if (counts[b])
+				{
+					accumulated = count ? accumulated.Union(bin_bounds[b]) : bin_bounds[b];
+					count += counts[b];
+				}
+				right_cost[b] = count ? accumulated.SurfaceArea() * count : 0.f;
+			}
+
+			int best_split = -1;
+			float best_cost = FLT_MAX;
+			count = 0;
+			for (int b = 0; b < BINS - 1; ++b)
+			{
+				if (counts[b])
+				{
+					accumulated = count ? accumulated.Union(bin_bounds[b]) : bin_bounds[b];
+					count += counts[b];
+				}
+				float cost = (count ? accumulated.SurfaceArea() * count : 0.f) + right_cost[b + 1];
+				if (count && cost < best_cost)
+				{
+					best_cost = cost;
+					best_split = b;
+				}
+			}
+
+			return uint32_t(std::partition(index_storage.begin() + begin, index_storage.begin() + end,
+				[&](uint32_t primitive) { return bin_of(primitive) <= best_split; }) - index_storage.begin());
+		}
+
+		std::vector<FlatBVHNode> node_storage;
+		std::vector<uint32_t> index_storage;
+		std::vector<FlatBVHMotion> motion_storage;
+		std::vector<vec3> centroids; //only alive during Build
+		std::vector<AABB> const* close_bounds{ nullptr }; //only during Build
+	};
+}
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "Film.h"
+
+using namespace glm;
+
+//a named float channel, read per pixel of the film being written
+struct OutputChannel
+{
+	std::string name;
+	std::function<float(Film const&, ivec2 const&)> value;
+};
+
+//the film's normalized color as R, G, B
+inline std::vector<OutputChannel> beauty_channels()
+{
+	return {
+		{ "R", [](Film const& film, ivec2 const& p) { return film.Resolve(p).r; } },
+		{ "G", [](Film const& film, ivec2 const& p) { return film.Resolve(p).g; } },
+		{ "B", [](Film const& film, ivec2 const& p) { return film.Resolve(p).b; } },
+	};
+}
+
+//Receives tiles of a film as soon as they are finished, so float output can go to disk while
+//rendering continues instead of waiting for (and copying) the whole frame.
+//WriteTile may be called from several threads at once.
+class TileWriter
+{
+public:
+	virtual ~TileWriter() {}
+	virtual bool Open(std::string const& path, Film const& film) = 0;
+	virtual void WriteTile(Film const& film, int tile) = 0;
+	virtual bool Close() = 0;
+};
+
+//Radiance RGBE (.hdr). The format is scanline based, so tiles are held back until their whole
+//row of tiles is done, then those scanlines are read straight from the film and written out.
+class HdrWriter : public TileWriter
+{
+public:
+	~HdrWriter()
+	{
+		Close();
+	}
+
+	bool Open(std::string const& path, Film const& film) override
+	{
+		file = fopen(path.c_str(), "wb");
+		if (!file)
+		{
+			std::cerr << "Could not open " << path << std::endl;
+			return false;
+		}
+		fprintf(file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\nEXPOSURE=1.0\n\n-Y %d +X %d\n", film.Height(), film.Width());
+		pending.assign(film.TilesY(), film.TilesX());
+		next_row = 0;
+		scanline.resize(film.Width() * 4);
+		return true;
+	}
+
+	void WriteTile(Film const& film, int tile) override
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!file)
+		{
+			return;
+		}
+		int tile_row = film.TileBounds(tile).y / film.TileSize();
+		--pending[tile_row];
+		//rows have to go out in order
+		while (next_row < int(pending.size()) && pending[next_row] == 0)
+		{
+			int y_end = glm::min((next_row + 1) * film.TileSize(), film.Height());
+			for (int y = next_row * film.TileSize(); y < y_end; ++y)
+			{
+				for (int x = 0; x < film.Width(); ++x)
+				{
+					Encode(film.Resolve(ivec2(x, y)), &scanline[x * 4]);
+				}
+				fwrite(scanline.data(), 1, scanline.size(), file);
+			}
+			++next_row;
+		}
+	}
+
+	bool Close() override
+	{
+		if (!file)
+		{
+			return false;
+		}
+		bool complete = (next_row == int(pending.size()));
+		fclose(file);
+		file = nullptr;
+		return complete;
+	}
+
+private:
+
+	static void Encode(vec3 const& c, unsigned char* rgbe)
+	{
+		float m = glm::max(c.r, glm::max(c.g, c.b));
+		if (m < 1e-32f)
+		{
+			rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+			return;
+		}
+		int exponent;
+		float scale = frexp(m, &exponent) * 256.f / m;
+		rgbe[0] = (unsigned char)(glm::max(c.r, 0.f) * scale);
+		rgbe[1] = (unsigned char)(glm::max(c.g, 0.f) * scale);
+		rgbe[2] = (unsigned char)(glm::max(c.b, 0.f) * scale);
+		rgbe[3] = (unsigned char)(exponent + 128);
+	}
+
+	FILE* file{ nullptr };
+	std::mutex mutex;
+	std::vector<int> pending; //unfinished tiles per row of tiles
+	int next_row{ 0 };
+	std::vector<unsigned char> scanline;
+};
+
+//Minimal tiled OpenEXR writer: uncompressed 32-bit float channels, one tile per film tile.
+//Tiles are appended in whatever order they finish (line order RANDOM_Y) and the offset table
+//is filled in on Close. The film only provides the tiling; pixel values come from the channels.
+class ExrWriter : public TileWriter
+{
+public:
+	ExrWriter(std::vector<OutputChannel> channels) : channels(std::move(channels))
+	{
+		//EXR wants channels sorted by name
+		std::sort(this->channels.begin(), this->channels.end(),
+			[](OutputChannel const& a, OutputChannel const& b) { return a.name < b.name; });
+	}
+
+	~ExrWriter()
+	{
+		Close();
+	}
+
+	bool Open(std::string const& path, Film const& film) override
+	{
+		file = fopen(path.c_str(), "wb");
+		if (!file)
+		{
+			std::cerr << "Could not open " << path << std::endl;
+			return false;
+		}
+		tile_size = film.TileSize();
+
+		std::vector<unsigned char> header;
+		Put32(header, 20000630);
+		//version 2, single part, tiled
+		Put32(header, 2 | 0x200);
+
+		std::vector<unsigned char> channel_list;
+		for (OutputChannel const& channel : channels)
+		{
+			PutString(channel_list, channel.name.c_str());
+			Put32(channel_list, 2); //FLOAT
+			Put32(channel_list, 0); //pLinear + reserved
+			Put32(channel_list, 1); //x sampling
+			Put32(channel_list, 1); //y sampling
+		}
+		channel_list.push_back(0);
+		PutAttribute(header, "channels", "chlist", channel_list);
+
+		PutAttribute(header, "compression", "compression", { 0 });
+
+		std::vector<unsigned char> window;
+		Put32(window, 0);
+		Put32(window, 0);
+		Put32(window, film.Width() - 1);
+		Put32(window, film.Height() - 1);
+		PutAttribute(header, "dataWindow", "box2i", window);
+		PutAttribute(header, "displayWindow", "box2i", window);
+
+		PutAttribute(header, "lineOrder", "lineOrder", { 2 }); //RANDOM_Y
+
+		std::vector<unsigned char> value;
+		PutFloat(value, 1.f);
+		PutAttribute(header, "pixelAspectRatio", "float", value);
+
+		value.clear();
+		PutFloat(value, 0.f);
+		PutFloat(value, 0.f);
+		PutAttribute(header, "screenWindowCenter", "v2f", value);
+
+		value.clear();
+		PutFloat(value, 1.f);
+		PutAttribute(header, "screenWindowWidth", "float", value);
+
+		value.clear();
+		Put32(value, tile_size);
+		Put32(value, tile_size);
+		value.push_back(0); //ONE_LEVEL, round down
+		PutAttribute(header, "tiles", "tiledesc", value);
+
+		header.push_back(0);
+
+		fwrite(header.data(), 1, header.size(), file);
+		offset_table_position = long(header.size());
+		offsets.assign(film.TileCount(), 0);
+		std::vector<unsigned char> zeros(offsets.size() * 8, 0);
+		fwrite(zeros.data(), 1, zeros.size(), file);
+		end_position = uint64_t(offset_table_position) + zeros.size();
+		return true;
+	}
+
+	void WriteTile(Film const& film, int tile) override
+	{
+		ivec4 bounds = film.TileBounds(tile);
+		ivec2 size = ivec2(bounds.z - bounds.x, bounds.w - bounds.y);
+		int data_size = size.x * size.y * int(channels.size()) * 4;
+
+		//encode outside of the lock, only the file append is serialized
+		std::vector<unsigned char> chunk;
+		chunk.reserve(20 + data_size);
+		Put32(chunk, bounds.x / tile_size);
+		Put32(chunk, bounds.y / tile_size);
+		Put32(chunk, 0); //level x
+		Put32(chunk, 0); //level y
+		Put32(chunk, data_size);
+		for (int y = bounds.y; y < bounds.w; ++y)
+		{
+			for (OutputChannel const& channel : channels)
+			{
+				for (int x = bounds.x; x < bounds.z; ++x)
+				{
+					PutFloat(chunk, channel.value(film, ivec2(x, y)));
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!file)
+		{
+			return;
+		}
+		//chunks are only ever appended, so the file position stays at the end until Close
+		fwrite(chunk.data(), 1, chunk.size(), file);
+		//the offset table is in tile order, which for a single level is the film's tile order
+		offsets[tile] = end_position;
+		end_position += chunk.size();
+	}
+
+	bool Close() override
+	{
+		if (!file)
+		{
+			return false;
+		}
+		bool complete = true;
+		std::vector<unsigned char> table;
+		for (uint64_t offset : offsets)
+		{
+			complete = complete && (offset != 0);
+			Put32(table, uint32_t(offset));
+			Put32(table, uint32_t(offset >> 32));
+		}
+		fseek(file, offset_table_position, SEEK_SET);
+		fwrite(table.data(), 1, table.size(), file);
+		fclose(file);
+		file = nullptr;
+		return complete;
+	}
+
+private:
+
+	//EXR is little endian
+	static void Put32(std::vector<unsigned char>& out, uint32_t v)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			out.push_back((unsigned char)(v >> (8 * i)));
+		}
+	}
+
+	static void PutFloat(std::vector<unsigned char>& out, float f)
+	{
+		uint32_t bits;
+		memcpy(&bits, &f, 4);
+		Put32(out, bits);
+	}
+
+	static void PutString(std::vector<unsigned char>& out, char const* s)
+	{
+		out.insert(out.end(), s, s + strlen(s) + 1);
+	}
+
+	static void PutAttribute(std::vector<unsigned char>& out, char const* name, char const* type, std::vector<unsigned char> const& value)
+	{
+		PutString(out, name);
+		PutString(out, type);
+		Put32(out, uint32_t(value.size()));
+		out.insert(out.end(), value.begin(), value.end());
+	}
+
+	std::vector<OutputChannel> channels;
+	FILE* file{ nullptr };
+	std::mutex mutex;
+	int tile_size{ 0 };
+	long offset_table_position{ 0 };
+	uint64_t end_position{ 0 };
+	std::vector<uint64_t> offsets;
+};
+
+//lower-case extension without the dot
+inline std::string file_extension(std::string const& path)
+{
+	size_t dot = path.find_last_of('.');
+	std::string extension = (dot == std::string::npos) ? "" : path.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(tolower(c)); });
+	return extension;
+}
+
+//Picks a streaming writer from the file extension, null for formats that need the whole image.
+//EXR files get the given channels, formats that only hold color ignore them.
+inline std::unique_ptr<TileWriter> make_tile_writer(std::string const& path, std::vector<OutputChannel> const& channels)
+{
+	std::string extension = file_extension(path);
+	if (extension == "hdr")
+	{
+		return std::unique_ptr<TileWriter>(new HdrWriter());
+	}
+	if (extension == "exr")
+	{
+		return std::unique_ptr<TileWriter>(new ExrWriter(channels));
+	}
+	return nullptr;
+}
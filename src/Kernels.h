@@ -0,0 +1,248 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "Cpu.h"
+#include "ray.h"
+
+//The hot loops, written once as plain lane loops and compiled for every instruction set
+//level with target attributes, so one binary vectorizes as wide as the machine allows.
+//The best level is picked by CPUID on first use, or forced with select().
+//All levels compute the same IEEE results as the scalar code, as long as the build doesn't
+//contract multiply-adds into FMAs (CMakeLists.txt turns that off).
+namespace kernels
+{
+	//primitives tested at once, as many as a BVH leaf usually holds; larger leaves go in batches
+	int const LANES = 4;
+
+	//Spheres and triangles as structures of arrays in the BVH's leaf order, so a leaf's
+	//primitives are next to each other. Every slot has an entry in both, slots holding the
+	//other kind can't be hit: a NaN radius, or degenerate edges. Each array has LANES extra
+	//slots at the end, so a batch never reads past it.
+	struct SphereLanes
+	{
+		std::vector<float> cx, cy, cz, r;
+		std::vector<float> mx, my, mz; //motion over the scene's time
+
+		void Resize(size_t slots)
+		{
+			for (std::vector<float>* a : { &cx, &cy, &cz, &mx, &my, &mz })
+			{
+				a->assign(slots + LANES, 0.f);
+			}
+			r.assign(slots + LANES, std::numeric_limits<float>::quiet_NaN());
+		}
+
+		bool Empty() const { return r.empty(); }
+	};
+
+	//first vertex and the two edges from it, like Moller-Trumbore wants them
+	struct TriangleLanes
+	{
+		std::vector<float> ax, ay, az;
+		std::vector<float> e1x, e1y, e1z;
+		std::vector<float> e2x, e2y, e2z;
+
+		void Resize(size_t slots)
+		{
+			for (std::vector<float>* a : { &ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z })
+			{
+				a->assign(slots + LANES, 0.f);
+			}
+		}
+
+		bool Empty() const { return ax.empty(); }
+	};
+
+#if defined(_MSC_VER)
+#define RT_KERNEL_INLINE __forceinline
+#else
+#define RT_KERNEL_INLINE inline __attribute__((always_inline))
+#endif
+
+	//the nearest of LANES hit distances, as its lane, shrinking t_max to it
+	RT_KERNEL_INLINE int nearest_lane(float const* t, float& t_max)
+	{
+		int best = -1;
+		for (int i = 0; i < LANES; ++i)
+		{
+			if (t[i] < t_max)
+			{
+				t_max = t[i];
+				best = i;
+			}
+		}
+		return best;
+	}
+
+	//same arithmetic as Scene::IntersectSphere, so the chosen sphere hits there too.
+	//Returns the nearest hit's slot relative to begin, or -1.
+	RT_KERNEL_INLINE int nearest_sphere_impl(SphereLanes const& p, uint32_t begin, uint32_t count, Ray const& ray, float t_min, float& t_max)
+	{
+		float const ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+		float const dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+		float const time = ray.time;
+		float const a = dx * dx + dy * dy + dz * dz;
+		float const limit = t_max;
+		int nearest = -1;
+		for (uint32_t batch = 0; batch < count; batch += LANES)
+		{
+			float const* cx = &p.cx[begin + batch], * cy = &p.cy[begin + batch], * cz = &p.cz[begin + batch];
+			float const* mx = &p.mx[begin + batch], * my = &p.my[begin + batch], * mz = &p.mz[begin + batch];
+			float const* r = &p.r[begin + batch];
+			uint32_t const valid_lanes = count - batch;
+			float half_b[LANES], discriminant[LANES];
+			bool any = false;
+			for (int i = 0; i < LANES; ++i)
+			{
+				float ocx = ox - (cx[i] + time * mx[i]), ocy = oy - (cy[i] + time * my[i]), ocz = oz - (cz[i] + time * mz[i]);
+				half_b[i] = ocx * dx + ocy * dy + ocz * dz;
+				float c = (ocx * ocx + ocy * ocy + ocz * ocz) - r[i] * r[i];
+				discriminant[i] = half_b[i] * half_b[i] - a * c;
+				any |= uint32_t(i) < valid_lanes && discriminant[i] >= 0;
+			}
+			//most rays miss all of a leaf's spheres, skip the square roots and divisions then
+			if (!any)
+			{
+				continue;
+			}
+			float t[LANES];
+			for (int i = 0; i < LANES; ++i)
+			{
+				float root = std::sqrt(discriminant[i] > 0 ? discriminant[i] : 0.f);
+				float near_t = (-half_b[i] - root) / a;
+				float far_t = (-half_b[i] + root) / a;
+				float hit_t = (near_t > t_min && near_t < limit) ? near_t : far_t;
+				bool valid = uint32_t(i) < valid_lanes && discriminant[i] >= 0 && hit_t > t_min && hit_t < limit;
+				t[i] = valid ? hit_t : std::numeric_limits<float>::infinity();
+			}
+			int lane = nearest_lane(t, t_max);
+			nearest = (lane >= 0) ? int(batch) + lane : nearest;
+		}
+		return nearest;
+	}
+
+	//same arithmetic as Scene::IntersectTriangle
+	RT_KERNEL_INLINE int nearest_triangle_impl(TriangleLanes const& p, uint32_t begin, uint32_t count, Ray const& ray, float t_min, float& t_max)
+	{
+		float const ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+		float const dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+		float const limit = t_max;
+		int nearest = -1;
+		for (uint32_t batch = 0; batch < count; batch += LANES)
+		{
+			uint32_t const slot = begin + batch;
+			float const* ax = &p.ax[slot], * ay = &p.ay[slot], * az = &p.az[slot];
+			float const* e1x = &p.e1x[slot], * e1y = &p.e1y[slot], * e1z = &p.e1z[slot];
+			float const* e2x = &p.e2x[slot], * e2y = &p.e2y[slot], * e2z = &p.e2z[slot];
+			uint32_t const valid_lanes = count - batch;
+			float t[LANES];
+			for (int i = 0; i < LANES; ++i)
+			{
+				float px = dy * e2z[i] - e2y[i] * dz;
+				float py = dz * e2x[i] - e2z[i] * dx;
+				float pz = dx * e2y[i] - e2x[i] * dy;
+				float det = e1x[i] * px + e1y[i] * py + e1z[i] * pz;
+				float inv_det = 1.f / det;
+				float sx = ox - ax[i], sy = oy - ay[i], sz = oz - az[i];
+				float u = (sx * px + sy * py + sz * pz) * inv_det;
+				float qx = sy * e1z[i] - e1y[i] * sz;
+				float qy = sz * e1x[i] - e1z[i] * sx;
+				float qz = sx * e1y[i] - e1x[i] * sy;
+				float v = (dx * qx + dy * qy + dz * qz) * inv_det;
+				float hit_t = (e2x[i] * qx + e2y[i] * qy + e2z[i] * qz) * inv_det;
+				bool valid = uint32_t(i) < valid_lanes && std::abs(det) >= 1e-12f &&
+					u >= 0 && u <= 1 && v >= 0 && u + v <= 1 && hit_t > t_min && hit_t < limit;
+				t[i] = valid ? hit_t : std::numeric_limits<float>::infinity();
+			}
+			int lane = nearest_lane(t, t_max);
+			nearest = (lane >= 0) ? int(batch) + lane : nearest;
+		}
+		return nearest;
+	}
+
+	//count film texels (RGB sums and weight) to gamma 2 RGB8, as Film::ToRGB8 writes them
+	RT_KERNEL_INLINE void resolve_rgb8_impl(float const* src, int count, unsigned char* dst)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			float inv_weight = (src[i * 4 + 3] > 0) ? 1.f / src[i * 4 + 3] : 0.f;
+			for (int c = 0; c < 3; ++c)
+			{
+				float v = std::sqrt(glm::clamp(src[i * 4 + c] * inv_weight, 0.f, 1.f));
+				//magic number for float truncation
+				dst[i * 3 + c] = (unsigned char)(v * 255.99f);
+			}
+		}
+	}
+
+#define RT_DEFINE_KERNELS(suffix, attributes) \
+	attributes inline int nearest_sphere_##suffix(SphereLanes const& p, uint32_t begin, uint32_t count, Ray const& ray, float t_min, float& t_max) \
+	{ \
+		return nearest_sphere_impl(p, begin, count, ray, t_min, t_max); \
+	} \
+	attributes inline int nearest_triangle_##suffix(TriangleLanes const& p, uint32_t begin, uint32_t count, Ray const& ray, float t_min, float& t_max) \
+	{ \
+		return nearest_triangle_impl(p, begin, count, ray, t_min, t_max); \
+	} \
+	attributes inline void resolve_rgb8_##suffix(float const* src, int count, unsigned char* dst) \
+	{ \
+		resolve_rgb8_impl(src, count, dst); \
+	}
+
+	//whatever the compiler was told to target anyway
+	RT_DEFINE_KERNELS(generic, )
+
+	//MSVC has no per-function targets, it only has the level the whole build is for
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RT_KERNEL_LEVELS 1
+	RT_DEFINE_KERNELS(sse42, __attribute__((target("sse4.2,popcnt"))))
+	RT_DEFINE_KERNELS(avx2, __attribute__((target("avx2,fma,bmi,bmi2"))))
+	RT_DEFINE_KERNELS(avx512, __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl,avx2,fma,bmi,bmi2"))))
+#else
+#define RT_KERNEL_LEVELS 0
+#endif
+
+	struct Table
+	{
+		cpu::Isa isa;
+		int (*nearest_sphere)(SphereLanes const&, uint32_t, uint32_t, Ray const&, float, float&);
+		int (*nearest_triangle)(TriangleLanes const&, uint32_t, uint32_t, Ray const&, float, float&);
+		void (*resolve_rgb8)(float const*, int, unsigned char*);
+	};
+
+	//the kernels built for isa, or for the highest level below it
+	inline Table table_for(cpu::Isa isa)
+	{
+#if RT_KERNEL_LEVELS
+		switch (isa)
+		{
+		case cpu::Isa::AVX512: return Table{ isa, nearest_sphere_avx512, nearest_triangle_avx512, resolve_rgb8_avx512 };
+		case cpu::Isa::AVX2: return Table{ isa, nearest_sphere_avx2, nearest_triangle_avx2, resolve_rgb8_avx2 };
+		case cpu::Isa::SSE42: return Table{ isa, nearest_sphere_sse42, nearest_triangle_sse42, resolve_rgb8_sse42 };
+		default: break;
+		}
+#endif
+		return Table{ cpu::Isa::Generic, nearest_sphere_generic, nearest_triangle_generic, resolve_rgb8_generic };
+	}
+
+	inline Table& active()
+	{
+		static Table table = table_for(cpu::detect());
+		return table;
+	}
+
+	//before rendering starts; levels the processor lacks fall back to the detected one
+	inline cpu::Isa select(cpu::Isa isa)
+	{
+		cpu::Isa detected = cpu::detect();
+		active() = table_for(isa > detected ? detected : isa);
+		return active().isa;
+	}
+}
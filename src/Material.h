@@ -1,40 +1,94 @@
 #pragma once
 #include <3rdparty/glm/glm.hpp>
 #include <3rdparty/glm/gtc/random.hpp>
+#include <3rdparty/glm/gtc/constants.hpp>
+#include <memory>
 #include "ray.h"
 #include "rt_math.h"
+#include "Texture.h"
 
 using namespace glm;
 
 class Material
 {
 public:
+	Material() : id(NextId()) {}
+
 	virtual bool Scatter(Ray const& ray_in, HitRecord const& rec, vec3& attenuation, Ray& ray_scattered) const = 0;
+
+	//radiance leaving the surface on its own
+	virtual vec3 Emitted() const { return vec3(0); }
+
+	//Mirrors and glass only scatter along a few discrete directions, so lights can't be sampled
+	//explicitly for them and have to be found by the scattered ray instead.
+	virtual bool IsSpecular() const { return true; }
+
+	//BRDF * cos towards a light, only meaningful for non-specular materials
+	virtual vec3 Evaluate(HitRecord const& rec, vec3 const& direction) const { return vec3(0); }
+
+	//density with which Scatter picks 'direction', per unit solid angle
+	virtual float Pdf(HitRecord const& rec, vec3 const& direction) const { return 0; }
+
+	//surface color without lighting at the hit, for the albedo AOV
+	virtual vec3 BaseColor(HitRecord const& rec) const { return vec3(1); }
+
+	//unique per material instance, in creation order
+	int id;
+
+private:
+	static int NextId()
+	{
+		static int count = 0;
+		return count++;
+	}
 };
 
 
 class Lambertian : public Material
 {
 public:
-	Lambertian(vec3 Albedo) : Albedo(Albedo) {}
+	Lambertian(vec3 Albedo, std::shared_ptr<Texture const> AlbedoMap = nullptr) : Albedo(Albedo), AlbedoMap(AlbedoMap) {}
 	bool Scatter(Ray const& ray_in, HitRecord const& rec, vec3& attenuation, Ray& ray_scattered) const override
 	{
-		vec3 direction = sample_in_sphere(vec3(0), vec3(1));
+		//a point on the unit sphere offset by the normal gives cosine-distributed directions
+		vec3 direction = sphericalRand(1.f);
 
 		direction += rec.normal;
 
-		ray_scattered = Ray(rec.point, direction);
-		attenuation = Albedo;
+		ray_scattered = Ray(rec.point, direction, ray_in.time);
+		attenuation = BaseColor(rec);
 		return true;
 	}
+
+	bool IsSpecular() const override
+	{
+		return false;
+	}
+
+	vec3 Evaluate(HitRecord const& rec, vec3 const& direction) const override
+	{
+		return BaseColor(rec) * (glm::max(0.f, dot(rec.normal, direction)) * one_over_pi<float>());
+	}
+
+	float Pdf(HitRecord const& rec, vec3 const& direction) const override
+	{
+		return glm::max(0.f, dot(rec.normal, normalize(direction))) * one_over_pi<float>();
+	}
+
+	vec3 BaseColor(HitRecord const& rec) const override
+	{
+		return AlbedoMap ? Albedo * AlbedoMap->Sample(rec.uv, rec.footprint) : Albedo;
+	}
 	
 	vec3 Albedo;
+	//multiplies Albedo when set
+	std::shared_ptr<Texture const> AlbedoMap;
 };
 
 class Metal : public Material
 {
 public:
-	Metal(vec3 Albedo, float Roughness=0.f) : Albedo(Albedo), Roughness(Roughness) {}
+	Metal(vec3 Albedo, float Roughness=0.f, std::shared_ptr<Texture const> AlbedoMap = nullptr) : Albedo(Albedo), Roughness(Roughness), AlbedoMap(AlbedoMap) {}
 	
 	bool Scatter(Ray const& ray_in, HitRecord const& rec, vec3& attenuation, Ray& ray_scattered) const override
 	{
@@ -46,13 +100,28 @@ public:
 			reflected += sample_in_sphere(rec.point + reflected, vec3(r, r, r));
 			reflected = normalize(reflected);
 		}
-		ray_scattered = Ray(rec.point, reflected);
-		attenuation = Albedo;
+		ray_scattered = Ray(rec.point, reflected, ray_in.time);
+		//a perfect mirror keeps the pixel footprint, treating the surface as locally flat
+		if (ray_in.has_differentials && Roughness <= 0)
+		{
+			ray_scattered.has_differentials = true;
+			ray_scattered.rx_origin = rec.point + rec.dpdx;
+			ray_scattered.ry_origin = rec.point + rec.dpdy;
+			ray_scattered.rx_direction = reflect(ray_in.rx_direction, rec.normal);
+			ray_scattered.ry_direction = reflect(ray_in.ry_direction, rec.normal);
+		}
+		attenuation = BaseColor(rec);
 		return true;
 	}
+
+	vec3 BaseColor(HitRecord const& rec) const override
+	{
+		return AlbedoMap ? Albedo * AlbedoMap->Sample(rec.uv, rec.footprint) : Albedo;
+	}
 	
 	float Roughness;
 	vec3 Albedo;
+	std::shared_ptr<Texture const> AlbedoMap;
 };
 
 class Dielectric : public Material
@@ -88,11 +157,48 @@ public:
 			reflected_prob = 1.0f;
 		}
 
-		vec3 out = (linearRand(0.f,1.f) < reflected_prob) ?
-			reflect(ray_in.direction, rec.normal) : refracted;
-		ray_scattered = Ray(rec.point, out);
+		bool reflects = linearRand(0.f,1.f) < reflected_prob;
+		vec3 out = reflects ? reflect(ray_in.direction, rec.normal) : refracted;
+		ray_scattered = Ray(rec.point, out, ray_in.time);
+
+		//bend the neighbouring rays the same way, treating the surface as locally flat
+		if (ray_in.has_differentials)
+		{
+			ray_scattered.rx_origin = rec.point + rec.dpdx;
+			ray_scattered.ry_origin = rec.point + rec.dpdy;
+			if (reflects)
+			{
+				ray_scattered.rx_direction = reflect(ray_in.rx_direction, rec.normal);
+				ray_scattered.ry_direction = reflect(ray_in.ry_direction, rec.normal);
+				ray_scattered.has_differentials = true;
+			}
+			else
+			{
+				ray_scattered.has_differentials =
+					refract(ray_in.rx_direction, outward_normal, ni_over_no, ray_scattered.rx_direction) &&
+					refract(ray_in.ry_direction, outward_normal, ni_over_no, ray_scattered.ry_direction);
+			}
+		}
 		return true;
 	}
 
 	float Index;
+};
+
+class DiffuseLight : public Material
+{
+public:
+	DiffuseLight(vec3 Emission) : Emission(Emission) {}
+
+	bool Scatter(Ray const& ray_in, HitRecord const& rec, vec3& attenuation, Ray& ray_scattered) const override
+	{
+		return false;
+	}
+
+	vec3 Emitted() const override
+	{
+		return Emission;
+	}
+
+	vec3 Emission;
 };
\ No newline at end of file
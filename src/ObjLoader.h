@@ -0,0 +1,627 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <omp.h>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "MappedFile.h"
+#include "Scene.h"
+#include "Trace.h"
+
+using namespace glm;
+
+//Wavefront OBJ/MTL import. The file is mapped and split into chunks at line boundaries, which are
+//parsed in parallel twice: once to count the vertex attributes, so every chunk knows where its
+//own start globally and relative indices resolve right away, then to read them.
+//Position/texcoord/normal combinations are deduplicated into one indexed vertex buffer.
+namespace obj
+{
+	uint32_t const NO_MATERIAL = 0xffffffff;
+
+	inline bool is_digit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	inline bool is_blank(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	//[-+]digits[.digits][(e|E)[-+]digits], without going past end or allocating like strtof/iostreams do
+	inline bool parse_float(char const*& p, char const* end, float& out)
+	{
+		static double const POWERS[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+		char const* s = p;
+		while (s < end && is_blank(*s))
+		{
+			++s;
+		}
+		bool negative = false;
+		if (s < end && (*s == '-' || *s == '+'))
+		{
+			negative = (*s == '-');
+			++s;
+		}
+		double value = 0;
+		int digits = 0, exponent = 0;
+		for (; s < end && is_digit(*s); ++s, ++digits)
+		{
+			value = value * 10 + (*s - '0');
+		}
+		if (s < end && *s == '.')
+		{
+			for (++s; s < end && is_digit(*s); ++s, ++digits)
+			{
+				value = value * 10 + (*s - '0');
+				--exponent;
+			}
+		}
+		if (digits == 0)
+		{
+			return false;
+		}
+		if (s < end && (*s == 'e' || *s == 'E'))
+		{
+			char const* e = s + 1;
+			bool negative_exponent = false;
+			if (e < end && (*e == '-' || *e == '+'))
+			{
+				negative_exponent = (*e == '-');
+				++e;
+			}
+			int written = 0;
+			for (; e < end && is_digit(*e); ++e)
+			{
+				written = glm::min(written * 10 + (*e - '0'), 1000);
+			}
+			if (e > s + 1 && is_digit(e[-1]))
+			{
+				exponent += negative_exponent ? -written : written;
+				s = e;
+			}
+		}
+		if (exponent < 0)
+		{
+			value = (exponent >= -22) ? value / POWERS[-exponent] : value * pow(10.0, exponent);
+		}
+		else if (exponent > 0)
+		{
+			value = (exponent <= 22) ? value * POWERS[exponent] : value * pow(10.0, exponent);
+		}
+		//too large for a float; geometry that far out only breaks the BVH
+		float result = float(negative ? -value : value);
+		if (!std::isfinite(result))
+		{
+			return false;
+		}
+		out = result;
+		p = s;
+		return true;
+	}
+
+	inline bool parse_int(char const*& p, char const* end, long& out)
+	{
+		char const* s = p;
+		bool negative = false;
+		if (s < end && (*s == '-' || *s == '+'))
+		{
+			negative = (*s == '-');
+			++s;
+		}
+		if (s == end || !is_digit(*s))
+		{
+			return false;
+		}
+		long value = 0;
+		for (; s < end && is_digit(*s); ++s)
+		{
+			value = value * 10 + (*s - '0');
+		}
+		out = negative ? -value : value;
+		p = s;
+		return true;
+	}
+
+	inline void skip_blanks(char const*& p, char const* end)
+	{
+		while (p < end && is_blank(*p))
+		{
+			++p;
+		}
+	}
+
+	//the rest of the line without surrounding blanks, for names and paths
+	inline std::string rest_of_line(char const* p, char const* end)
+	{
+		skip_blanks(p, end);
+		char const* last = p;
+		while (last < end && *last != '\n' && *last != '#')
+		{
+			++last;
+		}
+		while (last > p && (is_blank(last[-1])))
+		{
+			--last;
+		}
+		return std::string(p, last);
+	}
+
+	inline char const* next_line(char const* p, char const* end)
+	{
+		while (p < end && *p != '\n')
+		{
+			++p;
+		}
+		return (p < end) ? p + 1 : end;
+	}
+
+	//base of a path relative to the file it was found in
+	inline std::string resolve_path(std::string const& referencing_file, std::string const& path)
+	{
+		if (path.empty() || path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'))
+		{
+			return path;
+		}
+		size_t slash = referencing_file.find_last_of("/\\");
+		return (slash == std::string::npos) ? path : referencing_file.substr(0, slash + 1) + path;
+	}
+
+	//the properties of an MTL material the renderer has an equivalent for
+	struct MtlMaterial
+	{
+		vec3 diffuse{ 0.8f };
+		vec3 specular{ 0.f };
+		vec3 emission{ 0.f };
+		float shininess{ 0.f };
+		float ior{ 1.5f };
+		float dissolve{ 1.f };
+		int illum{ 2 };
+		std::string diffuse_map; //already relative to the working directory
+
+		//Transparent or refracting illumination models become glass, strongly specular
+		//materials without a diffuse part become metal with a fuzz from the Phong exponent.
+		//texture is the scene texture for the diffuse map, or -1.
+		MaterialDesc ToMaterial(int32_t texture) const
+		{
+			if (luminance(emission) > 0)
+			{
+				return MaterialDesc{ MaterialType::Light, emission, 0.f };
+			}
+			if (dissolve < 1.f || illum == 4 || illum == 6 || illum == 7)
+			{
+				return MaterialDesc{ MaterialType::Dielectric, vec3(1), ior };
+			}
+			if (luminance(specular) > luminance(diffuse) || (illum == 3 && luminance(specular) > 0))
+			{
+				return MaterialDesc{ MaterialType::Metal, specular, glm::min(1.f, sqrt(2.f / (shininess + 2.f))) };
+			}
+			//a diffuse map replaces Kd rather than tinting it
+			return MaterialDesc{ MaterialType::Lambertian, (texture >= 0) ? vec3(1) : diffuse, 0.f, texture };
+		}
+	};
+
+	inline bool parse_vec3(char const*& p, char const* end, vec3& out)
+	{
+		return parse_float(p, end, out.x) && parse_float(p, end, out.y) && parse_float(p, end, out.z);
+	}
+
+	inline bool load_mtl(std::string const& path, std::unordered_map<std::string, MtlMaterial>& materials)
+	{
+		MappedFile file;
+		if (!file.Open(path))
+		{
+			std::cerr << "Could not open material library " << path << std::endl;
+			return false;
+		}
+		char const* p = file.Data();
+		char const* end = p + file.Size();
+		MtlMaterial* current = nullptr;
+		for (; p < end; p = next_line(p, end))
+		{
+			skip_blanks(p, end);
+			char const* keyword = p;
+			while (p < end && !isspace((unsigned char)*p))
+			{
+				++p;
+			}
+			std::string key(keyword, p);
+			if (key == "newmtl")
+			{
+				current = &materials[rest_of_line(p, end)];
+				*current = MtlMaterial();
+			}
+			else if (!current)
+			{
+				continue;
+			}
+			else if (key == "Kd") parse_vec3(p, end, current->diffuse);
+			else if (key == "Ks") parse_vec3(p, end, current->specular);
+			else if (key == "Ke") parse_vec3(p, end, current->emission);
+			else if (key == "Ns") parse_float(p, end, current->shininess);
+			else if (key == "Ni") parse_float(p, end, current->ior);
+			else if (key == "d") parse_float(p, end, current->dissolve);
+			else if (key == "Tr")
+			{
+				float transparency;
+				if (parse_float(p, end, transparency))
+				{
+					current->dissolve = 1.f - transparency;
+				}
+			}
+			else if (key == "map_Kd")
+			{
+				//options before the file name aren't supported
+				current->diffuse_map = resolve_path(path, rest_of_line(p, end));
+			}
+			else if (key == "illum")
+			{
+				long illum;
+				skip_blanks(p, end);
+				if (parse_int(p, end, illum))
+				{
+					current->illum = int(illum);
+				}
+			}
+		}
+		return true;
+	}
+
+	//one face corner, global 0-based attribute indices, -1 if absent
+	struct Corner
+	{
+		int32_t position, texcoord, normal;
+	};
+
+	struct Chunk
+	{
+		char const* begin;
+		char const* end;
+
+		//first pass
+		uint32_t position_count{ 0 }, texcoord_count{ 0 }, normal_count{ 0 }, line_count{ 0 };
+
+		//second pass
+		std::vector<vec3> positions, normals;
+		std::vector<vec2> texcoords;
+		std::vector<Corner> corners; //three per triangle
+		std::vector<std::pair<size_t, std::string> > material_switches; //first triangle of each usemtl
+		std::vector<std::string> libraries;
+		std::string error;
+		uint32_t error_line{ 0 };
+	};
+
+	inline void count_chunk(Chunk& chunk)
+	{
+		for (char const* p = chunk.begin; p < chunk.end; p = next_line(p, chunk.end))
+		{
+			++chunk.line_count;
+			skip_blanks(p, chunk.end);
+			if (chunk.end - p > 2 && p[0] == 'v')
+			{
+				if (is_blank(p[1])) ++chunk.position_count;
+				else if (p[1] == 't' && is_blank(p[2])) ++chunk.texcoord_count;
+				else if (p[1] == 'n' && is_blank(p[2])) ++chunk.normal_count;
+			}
+		}
+	}
+
+	//first_* are the global indices of the chunk's first attributes
+	inline void parse_chunk(Chunk& chunk, uint32_t first_position, uint32_t first_texcoord, uint32_t first_normal)
+	{
+		char const* end = chunk.end;
+		chunk.positions.reserve(chunk.position_count);
+		chunk.texcoords.reserve(chunk.texcoord_count);
+		chunk.normals.reserve(chunk.normal_count);
+		std::vector<Corner> polygon;
+		uint32_t line = 0;
+
+		//OBJ indices are 1-based, negative ones count back from the latest attribute
+		auto resolve = [](long index, uint32_t first, size_t parsed, uint32_t total) -> int32_t
+		{
+			long global = (index < 0) ? long(first) + long(parsed) + index : index - 1;
+			return (index != 0 && global >= 0 && global < long(total)) ? int32_t(global) : -2;
+		};
+		uint32_t const position_total = first_position + chunk.position_count;
+		uint32_t const texcoord_total = first_texcoord + chunk.texcoord_count;
+		uint32_t const normal_total = first_normal + chunk.normal_count;
+
+		for (char const* p = chunk.begin; p < end; p = next_line(p, end))
+		{
+			++line;
+			skip_blanks(p, end);
+			if (p == end || *p == '#' || *p == '\n' || *p == '\r')
+			{
+				continue;
+			}
+			char const* statement = p;
+			bool ok = true;
+			if (p[0] == 'v' && end - p > 1 && is_blank(p[1]))
+			{
+				++p;
+				vec3 v;
+				ok = parse_vec3(p, end, v);
+				chunk.positions.push_back(v);
+			}
+			else if (p[0] == 'v' && end - p > 2 && p[1] == 't' && is_blank(p[2]))
+			{
+				p += 2;
+				vec2 uv;
+				ok = parse_float(p, end, uv.x);
+				//v is optional
+				if (!parse_float(p, end, uv.y))
+				{
+					uv.y = 0;
+				}
+				chunk.texcoords.push_back(uv);
+			}
+			else if (p[0] == 'v' && end - p > 2 && p[1] == 'n' && is_blank(p[2]))
+			{
+				p += 2;
+				vec3 n;
+				ok = parse_vec3(p, end, n);
+				chunk.normals.push_back(n);
+			}
+			else if (p[0] == 'f' && end - p > 1 && is_blank(p[1]))
+			{
+				++p;
+				polygon.clear();
+				while (true)
+				{
+					skip_blanks(p, end);
+					long index;
+					if (!parse_int(p, end, index))
+					{
+						break;
+					}
+					Corner corner{ resolve(index, first_position, chunk.positions.size(), position_total), -1, -1 };
+					if (p < end && *p == '/')
+					{
+						++p;
+						if (parse_int(p, end, index))
+						{
+							corner.texcoord = resolve(index, first_texcoord, chunk.texcoords.size(), texcoord_total);
+						}
+						if (p < end && *p == '/')
+						{
+							++p;
+							if (parse_int(p, end, index))
+							{
+								corner.normal = resolve(index, first_normal, chunk.normals.size(), normal_total);
+							}
+							else
+							{
+								ok = false;
+							}
+						}
+					}
+					ok = ok && corner.position >= 0 && corner.texcoord != -2 && corner.normal != -2;
+					polygon.push_back(corner);
+				}
+				ok = ok && polygon.size() >= 3;
+				//fan triangulation, fine for the convex polygons exporters write
+				for (size_t i = 2; ok && i < polygon.size(); ++i)
+				{
+					chunk.corners.push_back(polygon[0]);
+					chunk.corners.push_back(polygon[i - 1]);
+					chunk.corners.push_back(polygon[i]);
+				}
+			}
+			else if (end - p > 6 && std::equal(p, p + 6, "usemtl"))
+			{
+				chunk.material_switches.emplace_back(chunk.corners.size() / 3, rest_of_line(p + 6, end));
+			}
+			else if (end - p > 6 && std::equal(p, p + 6, "mtllib"))
+			{
+				chunk.libraries.push_back(rest_of_line(p + 6, end));
+			}
+			//groups, objects, smoothing groups, lines and points don't matter here
+
+			if (!ok)
+			{
+				char const* keyword_end = statement;
+				while (keyword_end < end && !isspace((unsigned char)*keyword_end))
+				{
+					++keyword_end;
+				}
+				chunk.error = "malformed '" + std::string(statement, keyword_end) + "'";
+				chunk.error_line = line;
+				return;
+			}
+		}
+	}
+
+	//Appends the mesh to the scene. override_material replaces the MTL materials when given.
+	inline bool load(std::string const& path, geometry::Scene& scene, uint32_t override_material = NO_MATERIAL)
+	{
+		typedef std::chrono::high_resolution_clock clock;
+		clock::time_point start = clock::now();
+
+		scene.source_files.push_back(path);
+		MappedFile file;
+		if (!file.Open(path))
+		{
+			std::cerr << "Could not open mesh " << path << std::endl;
+			return false;
+		}
+		char const* data = file.Data();
+		char const* data_end = data + file.Size();
+
+		//a few chunks per thread for balance, but no tiny ones
+		size_t const MIN_CHUNK_SIZE = 1 << 20;
+		size_t chunk_count = glm::max(size_t(1), glm::min(size_t(omp_get_max_threads()) * 4, file.Size() / MIN_CHUNK_SIZE));
+		std::vector<Chunk> chunks(chunk_count);
+		char const* chunk_begin = data;
+		for (size_t i = 0; i < chunk_count; ++i)
+		{
+			char const* chunk_end = (i + 1 == chunk_count) ? data_end : data + file.Size() * (i + 1) / chunk_count;
+			chunk_end = std::max(chunk_begin, chunk_end);
+			if (chunk_end < data_end && chunk_end > data && chunk_end[-1] != '\n')
+			{
+				chunk_end = next_line(chunk_end, data_end);
+			}
+			chunks[i].begin = chunk_begin;
+			chunks[i].end = chunk_end;
+			chunk_begin = chunk_end;
+		}
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < int(chunk_count); ++i)
+		{
+			TRACE_SCOPE("obj count", "chunk", i);
+			count_chunk(chunks[i]);
+		}
+		std::vector<uint32_t> first_position(chunk_count + 1, 0), first_texcoord(chunk_count + 1, 0), first_normal(chunk_count + 1, 0);
+		for (size_t i = 0; i < chunk_count; ++i)
+		{
+			first_position[i + 1] = first_position[i] + chunks[i].position_count;
+			first_texcoord[i + 1] = first_texcoord[i] + chunks[i].texcoord_count;
+			first_normal[i + 1] = first_normal[i] + chunks[i].normal_count;
+		}
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < int(chunk_count); ++i)
+		{
+			TRACE_SCOPE("obj parse", "chunk", i);
+			parse_chunk(chunks[i], first_position[i], first_texcoord[i], first_normal[i]);
+		}
+
+		uint32_t line_offset = 0;
+		for (Chunk const& chunk : chunks)
+		{
+			if (!chunk.error.empty())
+			{
+				std::cerr << path << ":" << line_offset + chunk.error_line << ": " << chunk.error << std::endl;
+				return false;
+			}
+			line_offset += chunk.line_count;
+		}
+
+		std::vector<vec3> positions, normals;
+		std::vector<vec2> texcoords;
+		positions.reserve(first_position[chunk_count]);
+		normals.reserve(first_normal[chunk_count]);
+		texcoords.reserve(first_texcoord[chunk_count]);
+		for (Chunk& chunk : chunks)
+		{
+			positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+			normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+			texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+			std::vector<vec3>().swap(chunk.positions);
+			std::vector<vec3>().swap(chunk.normals);
+			std::vector<vec2>().swap(chunk.texcoords);
+		}
+
+		//materials, by name, as they are first used
+		std::unordered_map<std::string, MtlMaterial> library;
+		if (override_material == NO_MATERIAL)
+		{
+			for (Chunk const& chunk : chunks)
+			{
+				for (std::string const& name : chunk.libraries)
+				{
+					//a missing library still counts, it may turn up later
+					scene.source_files.push_back(resolve_path(path, name));
+					load_mtl(scene.source_files.back(), library);
+				}
+			}
+		}
+		std::unordered_map<std::string, uint32_t> scene_materials;
+		auto scene_material = [&](std::string const& name) -> uint32_t
+		{
+			auto found = scene_materials.find(name);
+			if (found != scene_materials.end())
+			{
+				return found->second;
+			}
+			auto described = library.find(name);
+			MtlMaterial const& mtl = (described != library.end()) ? described->second : MtlMaterial();
+			int32_t texture = mtl.diffuse_map.empty() ? -1 : scene.AddTexture(mtl.diffuse_map);
+			uint32_t material = scene.AddMaterial(mtl.ToMaterial(texture));
+			scene_materials[name] = material;
+			return material;
+		};
+		uint32_t material = override_material;
+
+		//Unique corners become vertices. Each position heads a list of the vertices made from it,
+		//and corners only search that list for a matching texcoord and normal.
+		uint32_t const NONE = 0xffffffff;
+		uint32_t const first_vertex = uint32_t(scene.vertices.size());
+		std::vector<uint32_t> position_head(positions.size(), NONE);
+		std::vector<uint32_t> next_with_position;
+		std::vector<Corner> vertex_corners;
+		std::vector<MeshVertex> vertices;
+		std::vector<TrianglePrimitive> triangles;
+		vertices.reserve(positions.size());
+		next_with_position.reserve(positions.size());
+		vertex_corners.reserve(positions.size());
+		auto vertex_of = [&](Corner const& corner) -> uint32_t
+		{
+			uint32_t v = position_head[corner.position];
+			for (; v != NONE; v = next_with_position[v])
+			{
+				if (vertex_corners[v].texcoord == corner.texcoord && vertex_corners[v].normal == corner.normal)
+				{
+					return first_vertex + v;
+				}
+			}
+			v = uint32_t(vertices.size());
+			vertices.push_back(MeshVertex{ positions[corner.position],
+				(corner.normal >= 0) ? normals[corner.normal] : vec3(0),
+				(corner.texcoord >= 0) ? texcoords[corner.texcoord] : vec2(0) });
+			vertex_corners.push_back(corner);
+			next_with_position.push_back(position_head[corner.position]);
+			position_head[corner.position] = v;
+			return first_vertex + v;
+		};
+
+		for (Chunk const& chunk : chunks)
+		{
+			size_t next_switch = 0;
+			size_t chunk_triangles = chunk.corners.size() / 3;
+			for (size_t t = 0; t < chunk_triangles; ++t)
+			{
+				for (; next_switch < chunk.material_switches.size() && chunk.material_switches[next_switch].first == t; ++next_switch)
+				{
+					if (override_material == NO_MATERIAL)
+					{
+						material = scene_material(chunk.material_switches[next_switch].second);
+					}
+				}
+				if (material == NO_MATERIAL)
+				{
+					//faces before any usemtl
+					material = scene_material("");
+				}
+				Corner const* c = &chunk.corners[3 * t];
+				triangles.push_back(TrianglePrimitive{ vertex_of(c[0]), vertex_of(c[1]), vertex_of(c[2]), material });
+			}
+			//switches after the chunk's last face carry over into the next chunk
+			for (; next_switch < chunk.material_switches.size(); ++next_switch)
+			{
+				if (override_material == NO_MATERIAL)
+				{
+					material = scene_material(chunk.material_switches[next_switch].second);
+				}
+			}
+		}
+		scene.AddVertices(vertices);
+		scene.AddTriangles(triangles);
+
+		std::chrono::duration<double> time = clock::now() - start;
+		double megabytes = double(file.Size()) / (1 << 20);
+		std::cout << "obj: " << path << ", " << megabytes << "MB in " << time.count() << "s (" << megabytes / time.count() << "MB/s), "
+			<< vertices.size() << " vertices, " << triangles.size() << " triangles" << std::endl;
+		return true;
+	}
+}
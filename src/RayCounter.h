@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <omp.h>
+
+enum class RayType
+{
+	Camera,
+	Bounce, //scattered off a surface
+	Shadow, //towards a sampled light or the sky
+	Count
+};
+
+//Rays traced per type. Every thread counts into its own cache line, so counting
+//costs an increment and threads never share a line; totals are summed when asked for.
+class RayCounter
+{
+public:
+	RayCounter() { Reset(); }
+
+	//clears the counts and makes room for as many threads as OpenMP will start
+	void Reset()
+	{
+		slots.assign(size_t(omp_get_max_threads()), Slot());
+	}
+
+	//keeps the counts and makes room for threads added since, outside parallel regions only
+	void Fit()
+	{
+		if (slots.size() < size_t(omp_get_max_threads()))
+		{
+			slots.resize(size_t(omp_get_max_threads()));
+		}
+	}
+
+	void Add(RayType type)
+	{
+		size_t thread = size_t(omp_get_thread_num());
+		if (thread < slots.size())
+		{
+			++slots[thread].counts[int(type)];
+		}
+	}
+
+	uint64_t Total(RayType type) const
+	{
+		uint64_t total = 0;
+		for (Slot const& slot : slots)
+		{
+			total += slot.counts[int(type)];
+		}
+		return total;
+	}
+
+	uint64_t Total() const
+	{
+		uint64_t total = 0;
+		for (int type = 0; type < int(RayType::Count); ++type)
+		{
+			total += Total(RayType(type));
+		}
+		return total;
+	}
+
+	static char const* Name(RayType type)
+	{
+		switch (type)
+		{
+		case RayType::Camera: return "camera";
+		case RayType::Bounce: return "bounce";
+		case RayType::Shadow: return "shadow";
+		default: return "";
+		}
+	}
+
+private:
+	struct alignas(64) Slot
+	{
+		uint64_t counts[int(RayType::Count)]{};
+	};
+
+	std::vector<Slot> slots;
+};
@@ -0,0 +1,498 @@
+#include "Renderer.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <memory>
+
+#include <3rdparty/glm/gtc/random.hpp>
+
+#include "ObjLoader.h"
+#include "SceneCache.h"
+#include "SceneFile.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "rt_math.h"
+
+using namespace geometry;
+
+namespace rt
+{
+	//power heuristic for multiple importance sampling
+	static float mis_weight(float pdf, float other_pdf)
+	{
+		return (pdf * pdf) / (pdf * pdf + other_pdf * other_pdf);
+	}
+
+	//next-event estimation: pick one light through the light hierarchy and connect to it
+	static vec3 sample_lights(PathContext const& context, HitRecord const& rec, float time)
+	{
+		int light_index;
+		float pmf;
+		if (!context.lights.Sample(rec.point, rec.normal, linearRand(0.f, 1.f), light_index, pmf))
+		{
+			return vec3(0);
+		}
+		Sphere const& light = context.lights.Light(light_index);
+		vec3 direction;
+		float pdf;
+		if (!light.SampleDirection(rec.point, linearRand(vec2(0.f), vec2(1.f)), direction, pdf))
+		{
+			return vec3(0);
+		}
+		vec3 brdf = rec.mat->Evaluate(rec, direction);
+		if (brdf == vec3(0))
+		{
+			return vec3(0);
+		}
+		Ray shadow(rec.point, direction, time);
+		HitRecord light_rec, blocker_rec;
+		if (!light.Intersect(shadow, vec2(0.001, FLT_MAX), light_rec))
+		{
+			return vec3(0);
+		}
+		context.rays.Add(RayType::Shadow);
+		if (context.world.Intersect(shadow, vec2(0.001, light_rec.t * 0.999f), blocker_rec))
+		{
+			return vec3(0);
+		}
+		return brdf * light.material->Emitted() / (pdf * pmf);
+	}
+
+	//importance-samples the sky, weighted against the chance of the scattered ray finding the same direction
+	static vec3 sample_environment(PathContext const& context, HitRecord const& rec, float time)
+	{
+		vec3 direction;
+		float pdf;
+		vec3 radiance = context.environment.Sample(linearRand(vec2(0.f), vec2(1.f)), direction, pdf);
+		if (pdf == 0)
+		{
+			return vec3(0);
+		}
+		vec3 brdf = rec.mat->Evaluate(rec, direction);
+		if (brdf == vec3(0))
+		{
+			return vec3(0);
+		}
+		HitRecord blocker_rec;
+		context.rays.Add(RayType::Shadow);
+		if (context.world.Intersect(Ray(rec.point, direction, time), vec2(0.001, FLT_MAX), blocker_rec))
+		{
+			return vec3(0);
+		}
+		return brdf * radiance * (mis_weight(pdf, rec.mat->Pdf(rec, direction)) / pdf);
+	}
+
+	vec3 color(Ray const& r, PathContext const& context, int recursion_num, bool count_emission, float scatter_pdf, AOVSample* first_hit)
+	{
+		HitRecord rec;
+		context.rays.Add(recursion_num == 0 ? RayType::Camera : RayType::Bounce);
+		bool intersection = context.world.Intersect(r, vec2(0.001, FLT_MAX), rec);
+		//FIXME (OS): Magic number
+		if (intersection)
+		{
+			rec.ComputeDifferentials(r);
+			if (first_hit)
+			{
+				first_hit->depth = rec.t;
+				first_hit->position = rec.point;
+				first_hit->normal = rec.normal;
+				first_hit->albedo = rec.mat->BaseColor(rec);
+				first_hit->material_id = rec.mat->id;
+			}
+			vec3 emitted = (count_emission || !rec.light_sampled) ? rec.mat->Emitted() : vec3(0);
+			Ray scattered(vec3(0), vec3(0));
+			vec3 attenuation;
+			bool does_scatter = rec.mat->Scatter(r, rec, attenuation, scattered);
+			if (does_scatter && (recursion_num < context.max_depth))
+			{
+				bool explicit_lights = !rec.mat->IsSpecular() && !context.lights.Empty();
+				bool explicit_sky = !rec.mat->IsSpecular() && context.environment.Loaded();
+				vec3 direct(0);
+				if (explicit_lights)
+				{
+					direct += sample_lights(context, rec, r.time);
+				}
+				if (explicit_sky)
+				{
+					direct += sample_environment(context, rec, r.time);
+				}
+				float pdf = explicit_sky ? rec.mat->Pdf(rec, scattered.direction) : 0.f;
+				return emitted + direct + attenuation * color(scattered, context, recursion_num + 1, !explicit_lights, pdf);
+			}
+			else
+			{
+				STAT_PATH_END(recursion_num);
+				return emitted;
+			}
+		}
+
+		STAT_PATH_END(recursion_num);
+		if (context.environment.Loaded())
+		{
+			vec3 radiance = context.environment.Lookup(r.direction);
+			if (scatter_pdf > 0)
+			{
+				radiance *= mis_weight(scatter_pdf, context.environment.Pdf(r.direction));
+			}
+			return radiance;
+		}
+
+		// sky shading
+		vec3 dir = r.direction;
+
+		dir /= sqrt(dot(r.direction, r.direction));
+		float t = 0.5 * (dir.y + 1.0);
+		vec3 sky = r.direction * vec3(.5f) + vec3(.5f);
+		//vec3 sky = lerp(vec3(1, 1, 1), vec3(.5, .7, 1), t);
+		return sky;
+	}
+
+	void sample(PathContext const& context, Camera const& camera, ivec2 const& pos, int const num_samples, Randomization const randomization, FilmTile& film_tile, AOVBuffers* aovs)
+	{
+#if RT_STATS
+		uint64_t cost_before = stats::get().ThreadCost();
+#endif
+		for (int i = 0; i < num_samples; ++i)
+		{
+			vec2 film_pos = vec2(pos) + Camera::pixel_offset(randomization, i, num_samples);
+			Ray r = camera.make_ray(film_pos);
+			vec3 c;
+			if (aovs)
+			{
+				AOVSample first_hit;
+				c = color(r, context, 0, true, 0, &first_hit);
+				aovs->Add(pos, first_hit);
+			}
+			else
+			{
+				c = color(r, context, 0);
+			}
+			film_tile.AddSample(film_pos, c);
+		}
+#if RT_STATS
+		stats::get().SetPixelCost(pos, float(stats::get().ThreadCost() - cost_before) / num_samples);
+#endif
+	}
+
+	//(min, max) overlap of two pixel rectangles, empty if max <= min on either axis
+	static ivec4 overlap(ivec4 const& a, ivec4 const& b)
+	{
+		return ivec4(glm::max(ivec2(a.x, a.y), ivec2(b.x, b.y)), glm::min(ivec2(a.z, a.w), ivec2(b.z, b.w)));
+	}
+
+	static bool empty(ivec4 const& rect)
+	{
+		return rect.x >= rect.z || rect.y >= rect.w;
+	}
+
+	//pixels just outside the region splat into it, so they are sampled too (and only their splats inside kept)
+	static ivec4 sampled_pixels(Film const& film, ivec4 const& region)
+	{
+		int apron = film.Filter().Apron();
+		return overlap(region + ivec4(-apron, -apron, apron, apron), ivec4(0, 0, film.Width(), film.Height()));
+	}
+
+	Camera make_camera(RenderSettings const& settings, Film const& film)
+	{
+		Camera camera(settings.fov, settings.camera_position, settings.camera_up, settings.camera_lookat, settings.focus_distance, settings.aperture);
+		camera.set_image_size(ivec2(film.Width(), film.Height()));
+		camera.set_shutter(settings.shutter_open, settings.shutter_close);
+		return camera;
+	}
+
+	ivec4 render_region(RenderSettings const& settings, Film const& film)
+	{
+		ivec4 const frame(0, 0, film.Width(), film.Height());
+		return empty(settings.region) ? frame : overlap(settings.region, frame);
+	}
+
+	bool region_tile(Film const& film, ivec4 const& region, int tile)
+	{
+		return !empty(overlap(film.TileBounds(tile), sampled_pixels(film, region)));
+	}
+
+	void trace_tile(PathContext const& context, Camera const& camera, RenderSettings const& settings, Film const& film, ivec4 const& region, int tile, FilmTile& film_tile, AOVBuffers* aovs, std::vector<int> const* pixel_samples)
+	{
+		TRACE_SCOPE("tile", "tile", tile);
+		ivec4 bounds = overlap(film.TileBounds(tile), sampled_pixels(film, region));
+		for (int j = bounds.y; j < bounds.w; ++j)
+		{
+			bool row_inside = (j >= region.y && j < region.w);
+			for (int i = bounds.x; i < bounds.z; ++i)
+			{
+				bool inside = row_inside && i >= region.x && i < region.z;
+				int samples = pixel_samples ? (*pixel_samples)[size_t(j) * film.Width() + i] : settings.samples;
+				if (samples > 0)
+				{
+					sample(context, camera, ivec2(i, j), samples, settings.sampler, film_tile, inside ? aovs : nullptr);
+				}
+			}
+		}
+	}
+
+	int trace(PathContext const& context, RenderSettings const& settings, Film& film, AOVBuffers* aovs, std::vector<TileWriter*> const& writers, std::vector<int> const* pixel_samples)
+	{
+		Camera camera = make_camera(settings, film);
+		ivec4 const region = render_region(settings, film);
+		std::vector<std::vector<int> > tile_sets = film.IndependentTileSets();
+		for (std::vector<int>& tiles : tile_sets)
+		{
+			tiles.erase(std::remove_if(tiles.begin(), tiles.end(), [&](int tile) { return !region_tile(film, region, tile); }), tiles.end());
+		}
+		//a tile's pixels are final as soon as it's merged, unless neighbouring tiles splat into it
+		bool stream_tiles = (film.Filter().Apron() == 0);
+		if (stream_tiles)
+		{
+			TRACE_SCOPE("write tiles");
+			for (int tile = 0; tile < film.TileCount(); ++tile)
+			{
+				if (!region_tile(film, region, tile))
+				{
+					for (TileWriter* writer : writers)
+					{
+						writer->WriteTile(film, tile);
+					}
+				}
+			}
+		}
+		for (std::vector<int> const& tiles : tile_sets)
+		{
+			#pragma omp parallel for schedule(dynamic)
+			for (int k = 0; k < int(tiles.size()); ++k)
+			{
+				int tile = tiles[k];
+				FilmTile film_tile(film, tile, region);
+				trace_tile(context, camera, settings, film, region, tile, film_tile, aovs, pixel_samples);
+				{
+					TRACE_SCOPE("merge tile", "tile", tile);
+					film.MergeTile(film_tile);
+				}
+				if (stream_tiles)
+				{
+					TRACE_SCOPE("write tile", "tile", tile);
+					for (TileWriter* writer : writers)
+					{
+						writer->WriteTile(film, tile);
+					}
+				}
+			}
+		}
+		if (!stream_tiles)
+		{
+			TRACE_SCOPE("write tiles");
+			for (int tile = 0; tile < film.TileCount(); ++tile)
+			{
+				for (TileWriter* writer : writers)
+				{
+					writer->WriteTile(film, tile);
+				}
+			}
+		}
+		return 0;
+	}
+
+	void build_default_scene(Scene& scene, int n)
+	{
+
+		//hacky floor in the form of a sphere
+		scene.AddSphere(vec3(0, -1000, 0), 1000, scene.AddMaterial({ MaterialType::Lambertian, vec3(0.2f, 0.2, 0.7), 0 }));
+
+		for (int a = -n; a < n; ++a)
+		{
+			for (int b = -n; b < n; ++b)
+			{
+				float choose_mat = linearRand(0.f, 1.f);
+				vec3 center(a + 0.9* linearRand(0.f, 1.f), 0.2, b + 0.9 * linearRand(0.f, 1.f));
+				if (length(center - vec3(4.0, 0.2, 0)) > .9)
+				{
+					MaterialDesc material;
+					if (choose_mat < 0.8)
+					{
+						vec3 c = linearRand(vec3(0.f), vec3(1.f));
+						c = c*c;
+						material = { MaterialType::Lambertian, c, 0 };
+					}
+					else if (choose_mat < 0.9)
+					{
+						material = { MaterialType::Metal, linearRand(vec3(.5f), vec3(1.f)), linearRand(0.f, 0.5f) };
+					}
+					else if (choose_mat < 0.95)
+					{
+						material = { MaterialType::Light, linearRand(vec3(1.f), vec3(4.f)), 0 };
+					}
+					else
+					{
+						material = { MaterialType::Dielectric, vec3(1), 1.5 };
+					}
+					scene.AddSphere(center, 0.2f, scene.AddMaterial(material));
+				}
+			}
+		}
+
+		//Hero spheres
+		scene.AddSphere(vec3(0, 1, 0), 1.0, scene.AddMaterial({ MaterialType::Dielectric, vec3(1), 1.5 }));
+		scene.AddSphere(vec3(-4, 1, 0), 1.0, scene.AddMaterial({ MaterialType::Lambertian, vec3(0.5, 0.2, 0.5), 0 }));
+		scene.AddSphere(vec3(4, 1, 0), 1.0, scene.AddMaterial({ MaterialType::Metal, vec3(0.7, 0.6, 0.5), 0 }));
+	}
+
+	Renderer::Renderer(RenderSettings const& settings) : settings(settings), lights(std::vector<Sphere>())
+	{
+	}
+
+	bool Renderer::LoadScene()
+	{
+		TRACE_SCOPE("scene load");
+		world.texture_cache.SetBudget(size_t(settings.texture_cache) << 20);
+		built = false;
+		from_cache = !settings.scene_cache.empty() && scene_cache::load(settings.scene_cache, settings.scene, settings.bvh, world);
+		if (from_cache)
+		{
+			return true;
+		}
+		if (settings.scene.empty())
+		{
+			build_default_scene(world);
+			return true;
+		}
+		return (file_extension(settings.scene) == "obj") ? obj::load(settings.scene, world) : scene_file::load(settings.scene, world);
+	}
+
+	void Renderer::Build()
+	{
+		//a cached scene comes with its BVH, unless the world changed since
+		if (!from_cache || built)
+		{
+			world.Build(settings.bvh);
+			if (!settings.scene_cache.empty() && !from_cache)
+			{
+				TRACE_SCOPE("scene cache save");
+				scene_cache::save(settings.scene_cache, world, settings.scene, settings.bvh);
+			}
+		}
+		lights = LightBVH(world.Lights());
+		temporal.Clear();
+		built = true;
+	}
+
+	bool Renderer::LoadEnvironment(std::string const& path)
+	{
+		if (path == environment_path)
+		{
+			return true;
+		}
+		environment = EnvironmentMap();
+		environment_path.clear();
+		if (path.empty())
+		{
+			return true;
+		}
+		if (!environment.Load(path.c_str()))
+		{
+			return false;
+		}
+		environment_path = path;
+		return true;
+	}
+
+	int Renderer::Render(Film& film, AOVBuffers* aovs, std::vector<TileWriter*> const& writers)
+	{
+		if (!built)
+		{
+			Build();
+		}
+		//the thread count may have changed since the counter was made
+		rays.Fit();
+		if (!settings.temporal || !empty(settings.region))
+		{
+			//frames that don't leave history behind make what's there stale
+			temporal.Clear();
+			return trace(Context(), settings, film, aovs, writers);
+		}
+
+		//new samples go into a film of their own first, to be compared with the history
+		std::unique_ptr<AOVBuffers> first_hits(aovs ? nullptr : new AOVBuffers(film.Width(), film.Height()));
+		AOVBuffers& hits = aovs ? *aovs : *first_hits;
+		std::vector<int> samples;
+		{
+			TRACE_SCOPE("reproject");
+			samples = temporal.Plan(settings, film);
+		}
+		Film fresh(film.Width(), film.Height(), film.TileSize(), film.Filter());
+		trace(Context(), settings, fresh, &hits, {}, &samples);
+		{
+			TRACE_SCOPE("resolve history");
+			temporal.Resolve(settings, fresh, hits, film);
+		}
+		TRACE_SCOPE("write tiles");
+		for (int tile = 0; tile < film.TileCount(); ++tile)
+		{
+			for (TileWriter* writer : writers)
+			{
+				writer->WriteTile(film, tile);
+			}
+		}
+		return 0;
+	}
+
+	int Renderer::AddSamples(Film& film)
+	{
+		if (!built)
+		{
+			Build();
+		}
+		rays.Fit();
+		return trace(Context(), settings, film, nullptr, {});
+	}
+
+	CameraSettings Renderer::GetCamera() const
+	{
+		return CameraSettings{ settings.camera_position, settings.camera_lookat, settings.camera_up, settings.fov, settings.aperture, settings.focus_distance };
+	}
+
+	void Renderer::SetCamera(CameraSettings const& camera)
+	{
+		settings.camera_position = camera.position;
+		settings.camera_lookat = camera.lookat;
+		settings.camera_up = camera.up;
+		settings.fov = camera.fov;
+		settings.aperture = camera.aperture;
+		settings.focus_distance = camera.focus_distance;
+	}
+
+	void Renderer::RenderTile(Film const& film, int tile, FilmTile& film_tile)
+	{
+		trace_tile(Context(), make_camera(settings, film), settings, film, render_region(settings, film), tile, film_tile);
+	}
+
+	Progressive::Progressive(Renderer& renderer, int width, int height) : renderer(renderer),
+		film(width, height, renderer.Settings().tile_size, FilterTable(renderer.Settings().filter, renderer.Settings().filter_radius)),
+		camera(renderer.GetCamera())
+	{
+	}
+
+	int Progressive::Refine(int pass_samples)
+	{
+		if (renderer.GetCamera() != camera)
+		{
+			camera = renderer.GetCamera();
+			Restart();
+		}
+		int const settings_samples = renderer.Settings().samples;
+		renderer.Settings().samples = pass_samples;
+		//history goes into a frame once, the passes after that only add samples
+		int result = (samples == 0) ? renderer.Render(film) : renderer.AddSamples(film);
+		renderer.Settings().samples = settings_samples;
+		if (result != 0)
+		{
+			return samples;
+		}
+		samples += pass_samples;
+		return samples;
+	}
+
+	void Progressive::Restart()
+	{
+		film.Clear();
+		samples = 0;
+	}
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "AOV.h"
+#include "Camera.h"
+#include "Config.h"
+#include "Environment.h"
+#include "Film.h"
+#include "ImageWriter.h"
+#include "RayCounter.h"
+#include "Scene.h"
+#include "Temporal.h"
+#include "lights.h"
+
+using namespace glm;
+
+//The renderer as a library, for tools that render in-process instead of running rt.
+//Typical use:
+//	rt::Renderer renderer(settings);
+//	renderer.World().AddSphere(...);         //or LoadScene() for the scene in the settings
+//	renderer.Build();
+//	Film film(w, h, tile_size, filter);
+//	renderer.Render(film);                    //film.ToRGB8() or a TileWriter from here
+//Settings are read when rendering, so the camera and sample count can change between renders
+//without rebuilding anything (see SetCamera and Progressive).
+//A Renderer renders one film at a time, on as many threads as OpenMP is set up for.
+namespace rt
+{
+	//what a path needs besides its ray
+	struct PathContext
+	{
+		geometry::Hitable const& world;
+		geometry::LightBVH const& lights;
+		EnvironmentMap const& environment;
+		int max_depth;
+		RayCounter& rays;
+	};
+
+	//radiance arriving along r.
+	//count_emission is false when the previous bounce already sampled the lights explicitly.
+	//scatter_pdf is the density of the previous bounce picking r, or 0 if the sky wasn't sampled there.
+	//first_hit is only passed for camera rays, when AOVs are requested.
+	vec3 color(Ray const& r, PathContext const& context, int recursion_num, bool count_emission = true, float scatter_pdf = 0, AOVSample* first_hit = nullptr);
+
+	//splats num_samples samples taken in the pixel at pos into the film tile
+	void sample(PathContext const& context, Camera const& camera, ivec2 const& pos, int num_samples, Randomization randomization, FilmTile& film_tile, AOVBuffers* aovs = nullptr);
+
+	//the camera for settings, looking through the whole film
+	Camera make_camera(RenderSettings const& settings, Film const& film);
+
+	//settings.region clipped to the film, the whole film if the region is empty
+	ivec4 render_region(RenderSettings const& settings, Film const& film);
+
+	//whether rendering region samples pixels of the tile
+	bool region_tile(Film const& film, ivec4 const& region, int tile);
+
+	//samples the tile's pixels that splat into region (all of them, for the whole film) into film_tile
+	//pixel_samples overrides settings.samples per pixel, row by row over the whole film
+	void trace_tile(PathContext const& context, Camera const& camera, RenderSettings const& settings, Film const& film, ivec4 const& region, int tile, FilmTile& film_tile, AOVBuffers* aovs = nullptr, std::vector<int> const* pixel_samples = nullptr);
+
+	//Renders settings.samples more samples per pixel into the film (and AOVs, if given), handing finished tiles to the writers.
+	//Only pixels inside settings.region change; the writers still get every tile.
+	//pixel_samples, if given, replaces settings.samples per pixel as in trace_tile.
+	int trace(PathContext const& context, RenderSettings const& settings, Film& film, AOVBuffers* aovs = nullptr, std::vector<TileWriter*> const& writers = {}, std::vector<int> const* pixel_samples = nullptr);
+
+	//the random spheres scene everything was developed with, on a 2n x 2n grid
+	void build_default_scene(geometry::Scene& scene, int n = 4);
+
+	//everything a camera move changes; the rest of the settings, and the BVH, stay as they are
+	struct CameraSettings
+	{
+		vec3 position, lookat, up;
+		float fov, aperture, focus_distance;
+
+		bool operator==(CameraSettings const& other) const
+		{
+			return position == other.position && lookat == other.lookat && up == other.up
+				&& fov == other.fov && aperture == other.aperture && focus_distance == other.focus_distance;
+		}
+		bool operator!=(CameraSettings const& other) const { return !(*this == other); }
+	};
+
+	class Renderer
+	{
+	public:
+		explicit Renderer(RenderSettings const& settings = RenderSettings());
+
+		//camera, samples and the rest, read by every Render
+		RenderSettings& Settings() { return settings; }
+		RenderSettings const& Settings() const { return settings; }
+
+		//moving the camera only changes settings, the next Render traces the built scene from there
+		CameraSettings GetCamera() const;
+		void SetCamera(CameraSettings const& camera);
+
+		//add materials and primitives here, then Build
+		geometry::Scene& World() { return world; }
+		geometry::Scene const& World() const { return world; }
+
+		//Fills the world from settings.scene (the built-in scene if empty), or from settings.scene_cache
+		//if that is up to date, which makes Build only load the lights. Returns false if nothing loads.
+		bool LoadScene();
+		bool FromCache() const { return from_cache; }
+		bool Built() const { return built; }
+
+		//builds the BVH (and writes settings.scene_cache, if set and the scene wasn't loaded from it)
+		//and the light hierarchy; needed after the world changes and before rendering
+		void Build();
+
+		//replaces the sky with an HDR lat-long map, or the gradient for an empty path; the same path again is kept as is
+		bool LoadEnvironment(std::string const& path);
+
+		//Renders settings.samples more samples per pixel into the film, see trace. With settings.temporal,
+		//and no region, the previous frame rendered here is reprojected into the film first and pixels
+		//it covers get fewer new samples (see TemporalCache).
+		int Render(Film& film, AOVBuffers* aovs = nullptr, std::vector<TileWriter*> const& writers = {});
+		TemporalCache const& Temporal() const { return temporal; }
+
+		//Renders settings.samples more samples per pixel into a film Render started, leaving the temporal
+		//history alone, so further passes over one frame don't blend it in again (see Progressive).
+		int AddSamples(Film& film);
+
+		//Renders settings.samples samples per pixel of one tile into film_tile, which should be made for
+		//render_region(Settings(), film), without touching the film. For rendering tiles elsewhere, see Distributed.h.
+		//Needs Build first; safe to call for different tiles from several threads. Rays are only counted
+		//for as many threads as there were at the last ResetStats or Render.
+		void RenderTile(Film const& film, int tile, FilmTile& film_tile);
+
+		//rays traced since the last ResetStats, for throughput
+		RayCounter const& Rays() const { return rays; }
+		void ResetStats() { rays.Reset(); }
+
+	private:
+		PathContext Context() { return PathContext{ world, lights, environment, settings.max_depth, rays }; }
+
+		RenderSettings settings;
+		geometry::Scene world;
+		geometry::LightBVH lights;
+		EnvironmentMap environment;
+		std::string environment_path;
+		TemporalCache temporal;
+		RayCounter rays;
+		bool from_cache{ false };
+		bool built{ false };
+	};
+
+	//Progressive refinement for interactive use: every Refine adds samples to the same film until the
+	//camera moves, then the film starts over while the scene stays built. With settings.temporal only
+	//the first pass of a frame reprojects the previous one.
+	//	rt::Progressive view(renderer, 640, 360);
+	//	while (...) { renderer.SetCamera(...); view.Refine(1); show(view.Image()); }
+	class Progressive
+	{
+	public:
+		//the film's tile size and filter come from the renderer's settings
+		Progressive(Renderer& renderer, int width, int height);
+
+		//renders samples more per pixel, after clearing the film if the camera moved since the last pass;
+		//returns the samples per pixel in the film
+		int Refine(int samples);
+
+		//throws away what has been rendered, for changes other than the camera
+		void Restart();
+
+		Film const& Image() const { return film; }
+		int Samples() const { return samples; }
+
+	private:
+		Renderer& renderer;
+		Film film;
+		CameraSettings camera;
+		int samples{ 0 };
+	};
+}
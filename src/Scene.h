@@ -0,0 +1,425 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "ray.h"
+#include "Material.h"
+#include "geometry.h"
+#include "ArrayView.h"
+#include "FlatBVH.h"
+#include "Kernels.h"
+#include "MappedFile.h"
+#include "Texture.h"
+#include "Trace.h"
+
+using namespace glm;
+using std::shared_ptr;
+using std::make_shared;
+
+enum class MaterialType : uint32_t
+{
+	Lambertian,
+	Metal,
+	Dielectric,
+	Light
+};
+
+//plain description of a material, so scenes can be stored and rebuilt
+struct MaterialDesc
+{
+	MaterialType type;
+	vec3 color; //albedo, or emission for lights
+	float parameter; //roughness for metals, index of refraction for dielectrics
+	int32_t texture{ -1 }; //scene texture multiplying the albedo, if any
+
+	shared_ptr<Material> Instantiate(shared_ptr<Texture const> const& albedo_map) const
+	{
+		switch (type)
+		{
+		case MaterialType::Metal: return make_shared<Metal>(color, parameter, albedo_map);
+		case MaterialType::Dielectric: return make_shared<Dielectric>(parameter);
+		case MaterialType::Light: return make_shared<DiffuseLight>(color);
+		case MaterialType::Lambertian:
+		default: return make_shared<Lambertian>(color, albedo_map);
+		}
+	}
+};
+
+//centered at center + time * motion, for time in [0, 1]
+struct SpherePrimitive
+{
+	vec3 center;
+	float radius;
+	vec3 motion;
+	uint32_t material;
+
+	bool Moving() const { return motion != vec3(0); }
+};
+
+//32 bytes; a zero normal means the triangle is shaded flat
+struct MeshVertex
+{
+	vec3 position;
+	vec3 normal;
+	vec2 uv;
+};
+
+//indices into the scene's vertex buffer
+struct TrianglePrimitive
+{
+	uint32_t v0, v1, v2;
+	uint32_t material;
+};
+
+namespace geometry
+{
+	//Flat scene representation: materials and primitives live in plain arrays and reference each
+	//other by index, and one FlatBVH covers all primitives. Primitive ids below the sphere count
+	//are spheres, the rest triangles.
+	//The primitive arrays are either filled through Add* or attached from a mapped scene cache.
+	class Scene : public Hitable
+	{
+	public:
+
+		//loads an image texture once per path, returns -1 if it can't be loaded
+		int32_t AddTexture(std::string const& path)
+		{
+			for (size_t i = 0; i < texture_paths.size(); ++i)
+			{
+				if (texture_paths[i] == path)
+				{
+					return int32_t(i);
+				}
+			}
+			shared_ptr<Texture> texture = make_shared<Texture>(texture_cache);
+			if (!texture->Load(path))
+			{
+				return -1;
+			}
+			texture_paths.push_back(path);
+			textures.push_back(texture);
+			return int32_t(textures.size() - 1);
+		}
+
+		uint32_t AddMaterial(MaterialDesc const& desc)
+		{
+			material_descs.push_back(desc);
+			bool textured = desc.texture >= 0 && desc.texture < int32_t(textures.size());
+			materials.push_back(desc.Instantiate(textured ? textures[desc.texture] : nullptr));
+			return uint32_t(materials.size() - 1);
+		}
+
+		void AddSphere(vec3 const& center, float radius, uint32_t material, vec3 const& motion = vec3(0))
+		{
+			sphere_storage.push_back(SpherePrimitive{ center, radius, motion, material });
+			spheres = sphere_storage;
+		}
+
+		uint32_t AddVertex(MeshVertex const& vertex)
+		{
+			vertex_storage.push_back(vertex);
+			vertices = vertex_storage;
+			return uint32_t(vertex_storage.size() - 1);
+		}
+
+		void AddTriangle(uint32_t v0, uint32_t v1, uint32_t v2, uint32_t material)
+		{
+			triangle_storage.push_back(TrianglePrimitive{ v0, v1, v2, material });
+			triangles = triangle_storage;
+		}
+
+		//for loaders that fill whole buffers at once
+		void AddVertices(std::vector<MeshVertex> const& added)
+		{
+			vertex_storage.insert(vertex_storage.end(), added.begin(), added.end());
+			vertices = vertex_storage;
+		}
+
+		void AddTriangles(std::vector<TrianglePrimitive> const& added)
+		{
+			triangle_storage.insert(triangle_storage.end(), added.begin(), added.end());
+			triangles = triangle_storage;
+		}
+
+		//uses primitives and BVH straight from a mapped file, which the scene keeps open
+		void Attach(std::unique_ptr<MappedFile> file, ArrayView<SpherePrimitive> const& mapped_spheres, ArrayView<MeshVertex> const& mapped_vertices,
+			ArrayView<TrianglePrimitive> const& mapped_triangles, ArrayView<FlatBVHNode> const& nodes, ArrayView<uint32_t> const& indices,
+			ArrayView<FlatBVHMotion> const& motion)
+		{
+			sphere_storage.clear();
+			vertex_storage.clear();
+			triangle_storage.clear();
+			spheres = mapped_spheres;
+			vertices = mapped_vertices;
+			triangles = mapped_triangles;
+			bvh.Attach(nodes, indices, motion);
+			mapping = std::move(file);
+			BuildLanes();
+		}
+
+		void Build(BVHBuild build)
+		{
+			TRACE_SCOPE("bvh build", "primitives", int64_t(spheres.size() + triangles.size()));
+			std::vector<AABB> bounds;
+			bounds.reserve(spheres.size() + triangles.size());
+			bool moving = false;
+			for (SpherePrimitive const& s : spheres)
+			{
+				bounds.emplace_back(s.center - s.radius, s.center + s.radius);
+				moving = moving || s.Moving();
+			}
+			for (TrianglePrimitive const& t : triangles)
+			{
+				vec3 const& p0 = vertices[t.v0].position;
+				vec3 const& p1 = vertices[t.v1].position;
+				vec3 const& p2 = vertices[t.v2].position;
+				bounds.emplace_back(glm::min(p0, glm::min(p1, p2)), glm::max(p0, glm::max(p1, p2)));
+			}
+			if (!moving)
+			{
+				bvh.Build(bounds, build);
+				BuildLanes();
+				return;
+			}
+			//only spheres move, triangles are where they are at both ends of the shutter
+			std::vector<AABB> bounds_at_close(bounds);
+			for (size_t i = 0; i < spheres.size(); ++i)
+			{
+				bounds_at_close[i] = AABB(bounds[i].min__ + spheres[i].motion, bounds[i].max__ + spheres[i].motion);
+			}
+			bvh.Build(bounds, build, &bounds_at_close);
+			BuildLanes();
+		}
+
+		bool Intersect(Ray const& ray, vec2 t_range, HitRecord& rec) const override
+		{
+			kernels::Table const& k = kernels::active();
+			return bvh.Intersect(ray, t_range, rec,
+				[this, &k](uint32_t offset, uint32_t count, Ray const& r, vec2 const& range, HitRecord& hit) -> bool
+			{
+				return IntersectLeaf(k, offset, count, r, range, hit);
+			});
+		}
+
+		AABB Bounds() const override
+		{
+			return bvh.Bounds();
+		}
+
+		//emissive spheres as standalone objects, for the light hierarchy, which only knows still ones
+		std::vector<Sphere> Lights() const
+		{
+			std::vector<Sphere> lights;
+			for (SpherePrimitive const& s : spheres)
+			{
+				if (!s.Moving() && luminance(materials[s.material]->Emitted()) > 0)
+				{
+					lights.emplace_back(s.center, s.radius);
+					lights.back().material = materials[s.material];
+				}
+			}
+			return lights;
+		}
+
+		std::vector<MaterialDesc> material_descs;
+		std::vector<shared_ptr<Material> > materials; //one per material, not per primitive
+		std::vector<std::string> texture_paths;
+		std::vector<shared_ptr<Texture> > textures;
+		//tiles of all textures, within the budget set before loading
+		TextureCache texture_cache;
+		ArrayView<SpherePrimitive> spheres;
+		ArrayView<MeshVertex> vertices;
+		ArrayView<TrianglePrimitive> triangles;
+		FlatBVH bvh;
+
+		//camera and environment the scene asks for, as config keys and values
+		std::vector<std::pair<std::string, std::string> > settings;
+		//meshes and material libraries the loaders read besides the scene file, for telling when a cache is stale
+		std::vector<std::string> source_files;
+
+	private:
+
+		std::vector<SpherePrimitive> sphere_storage;
+		std::vector<MeshVertex> vertex_storage;
+		std::vector<TrianglePrimitive> triangle_storage;
+		std::unique_ptr<MappedFile> mapping;
+		//primitives again in leaf order for the kernels, rebuilt with the BVH
+		kernels::SphereLanes sphere_lanes;
+		kernels::TriangleLanes triangle_lanes;
+
+		//Finds the nearest primitive with the batch kernels, then fills in the hit record for just that one
+		bool IntersectLeaf(kernels::Table const& k, uint32_t offset, uint32_t count, Ray const& ray, vec2 const& t_range, HitRecord& rec) const
+		{
+			STAT_ADD_N(PrimitiveTests, count);
+			float t_max = t_range.y;
+			int nearest = sphere_lanes.Empty() ? -1 : k.nearest_sphere(sphere_lanes, offset, count, ray, t_range.x, t_max);
+			int nearest_triangle = triangle_lanes.Empty() ? -1 : k.nearest_triangle(triangle_lanes, offset, count, ray, t_range.x, t_max);
+			nearest = (nearest_triangle >= 0) ? nearest_triangle : nearest;
+			if (nearest < 0)
+			{
+				return false;
+			}
+			STAT_ADD(PrimitiveHits);
+			//the kernels do the same arithmetic, but the scalar test has the last word, and gets
+			//the whole leaf should it ever disagree
+			if (IntersectPrimitive(bvh.indices[offset + nearest], ray, t_range, rec))
+			{
+				return true;
+			}
+			bool hit = false;
+			vec2 range = t_range;
+			for (uint32_t i = offset; i < offset + count; ++i)
+			{
+				if (IntersectPrimitive(bvh.indices[i], ray, range, rec))
+				{
+					range.y = rec.t;
+					hit = true;
+				}
+			}
+			return hit;
+		}
+
+		//copies the primitives into the kernels' layout, in the order of the BVH's leaves
+		void BuildLanes()
+		{
+			size_t slots = bvh.indices.size();
+			sphere_lanes = kernels::SphereLanes();
+			triangle_lanes = kernels::TriangleLanes();
+			if (!spheres.empty())
+			{
+				sphere_lanes.Resize(slots);
+			}
+			if (!triangles.empty())
+			{
+				triangle_lanes.Resize(slots);
+			}
+			for (size_t slot = 0; slot < slots; ++slot)
+			{
+				uint32_t id = bvh.indices[slot];
+				if (id < spheres.size())
+				{
+					SpherePrimitive const& s = spheres[id];
+					sphere_lanes.cx[slot] = s.center.x; sphere_lanes.cy[slot] = s.center.y; sphere_lanes.cz[slot] = s.center.z;
+					sphere_lanes.r[slot] = s.radius;
+					sphere_lanes.mx[slot] = s.motion.x; sphere_lanes.my[slot] = s.motion.y; sphere_lanes.mz[slot] = s.motion.z;
+				}
+				else
+				{
+					TrianglePrimitive const& tri = triangles[id - spheres.size()];
+					vec3 const& a = vertices[tri.v0].position;
+					vec3 e1 = vertices[tri.v1].position - a;
+					vec3 e2 = vertices[tri.v2].position - a;
+					triangle_lanes.ax[slot] = a.x; triangle_lanes.ay[slot] = a.y; triangle_lanes.az[slot] = a.z;
+					triangle_lanes.e1x[slot] = e1.x; triangle_lanes.e1y[slot] = e1.y; triangle_lanes.e1z[slot] = e1.z;
+					triangle_lanes.e2x[slot] = e2.x; triangle_lanes.e2y[slot] = e2.y; triangle_lanes.e2z[slot] = e2.z;
+				}
+			}
+		}
+
+		bool IntersectPrimitive(uint32_t id, Ray const& ray, vec2 const& t_range, HitRecord& rec) const
+		{
+			return (id < spheres.size()) ?
+				IntersectSphere(spheres[id], ray, t_range, rec) :
+				IntersectTriangle(triangles[id - spheres.size()], ray, t_range, rec);
+		}
+
+		bool IntersectSphere(SpherePrimitive const& s, Ray const& ray, vec2 const& t_range, HitRecord& rec) const
+		{
+			vec3 center = s.center + ray.time * s.motion;
+			vec3 oc = ray.origin - center;
+			float a = dot(ray.direction, ray.direction);
+			float half_b = dot(oc, ray.direction);
+			float c = dot(oc, oc) - s.radius * s.radius;
+			float discriminant = half_b * half_b - a * c;
+			if (discriminant < 0)
+			{
+				return false;
+			}
+			float root = sqrt(discriminant);
+			float t = (-half_b - root) / a;
+			if (!(t > t_range.x && t < t_range.y))
+			{
+				t = (-half_b + root) / a;
+				if (!(t > t_range.x && t < t_range.y))
+				{
+					return false;
+				}
+			}
+			rec.t = t;
+			rec.point = ray.At(t);
+			rec.normal = (rec.point - center) / s.radius;
+			rec.uv = vec2(0.5f + atan2(rec.normal.z, rec.normal.x) * one_over_two_pi<float>(),
+				0.5f + asin(glm::clamp(rec.normal.y, -1.f, 1.f)) * one_over_pi<float>());
+			//u is longitude and v latitude, both scaled to [0, 1]; degenerate at the poles
+			vec3 q = rec.point - center;
+			float rho = sqrt(q.x * q.x + q.z * q.z);
+			rec.dpdu = two_pi<float>() * vec3(-q.z, 0, q.x);
+			rec.dpdv = (rho > 0) ? pi<float>() * vec3(-q.y * q.x / rho, rho, -q.y * q.z / rho) : vec3(0);
+			rec.mat = materials[s.material].get();
+			rec.light_sampled = !s.Moving();
+			return true;
+		}
+
+		//Moller-Trumbore
+		bool IntersectTriangle(TrianglePrimitive const& tri, Ray const& ray, vec2 const& t_range, HitRecord& rec) const
+		{
+			MeshVertex const& a = vertices[tri.v0];
+			MeshVertex const& b = vertices[tri.v1];
+			MeshVertex const& c = vertices[tri.v2];
+			vec3 e1 = b.position - a.position;
+			vec3 e2 = c.position - a.position;
+			vec3 p = cross(ray.direction, e2);
+			float det = dot(e1, p);
+			if (abs(det) < 1e-12f)
+			{
+				return false;
+			}
+			float inv_det = 1.f / det;
+			vec3 s = ray.origin - a.position;
+			float u = dot(s, p) * inv_det;
+			if (u < 0 || u > 1)
+			{
+				return false;
+			}
+			vec3 q = cross(s, e1);
+			float v = dot(ray.direction, q) * inv_det;
+			if (v < 0 || u + v > 1)
+			{
+				return false;
+			}
+			float t = dot(e2, q) * inv_det;
+			if (!(t > t_range.x && t < t_range.y))
+			{
+				return false;
+			}
+			rec.t = t;
+			rec.point = ray.At(t);
+			//interpolated normals only where the mesh has them
+			vec3 normal = (1 - u - v) * a.normal + u * b.normal + v * c.normal;
+			rec.normal = (a.normal != vec3(0) && b.normal != vec3(0) && c.normal != vec3(0) && normal != vec3(0)) ?
+				normalize(normal) : normalize(cross(e1, e2));
+			rec.uv = (1 - u - v) * a.uv + u * b.uv + v * c.uv;
+			vec2 duv1 = b.uv - a.uv, duv2 = c.uv - a.uv;
+			float uv_det = duv1.x * duv2.y - duv1.y * duv2.x;
+			if (abs(uv_det) > 1e-12f)
+			{
+				rec.dpdu = (duv2.y * e1 - duv1.y * e2) / uv_det;
+				rec.dpdv = (duv1.x * e2 - duv2.x * e1) / uv_det;
+			}
+			else
+			{
+				//rec may still hold another primitive's from earlier in the traversal
+				rec.dpdu = rec.dpdv = vec3(0);
+			}
+			rec.mat = materials[tri.material].get();
+			rec.light_sampled = false;
+			return true;
+		}
+	};
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "ArrayView.h"
+#include "FlatBVH.h"
+#include "MappedFile.h"
+#include "Scene.h"
+
+//Binary scene cache: the flat primitive arrays and the built BVH exactly as they are in memory,
+//each section 64-byte aligned, so a cached scene is mapped and used without being read or rebuilt.
+//The header remembers the source file's size and modification time and the BVH build, a section
+//those of every mesh, material library and texture the scene refers to, and a cache that doesn't
+//match any of them is ignored and rewritten.
+namespace scene_cache
+{
+	uint32_t const VERSION = 5;
+	uint32_t const BYTE_ORDER_MARK = 0x01020304;
+	size_t const SECTION_ALIGNMENT = 64;
+
+	struct Section
+	{
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order;
+		//struct layouts depend on the compiler, so only a matching build reads a cache back
+		uint32_t material_size, sphere_size, vertex_size, triangle_size, node_size;
+		uint32_t bvh_build;
+		uint64_t source_size;
+		int64_t source_time;
+		Section textures, materials, spheres, vertices, triangles, nodes, indices, motion, settings, dependencies;
+	};
+
+	//size and modification time, both zero for files that don't exist
+	inline void file_stamp(std::string const& path, uint64_t& size, int64_t& time)
+	{
+		struct stat info;
+		size = 0;
+		time = 0;
+		if (stat(path.c_str(), &info) == 0)
+		{
+			size = uint64_t(info.st_size);
+			time = int64_t(info.st_mtime);
+		}
+	}
+
+	inline void init_header(Header& header, std::string const& source, geometry::BVHBuild build)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "RTSCENE", 8);
+		header.version = VERSION;
+		header.byte_order = BYTE_ORDER_MARK;
+		header.material_size = sizeof(MaterialDesc);
+		header.sphere_size = sizeof(SpherePrimitive);
+		header.vertex_size = sizeof(MeshVertex);
+		header.triangle_size = sizeof(TrianglePrimitive);
+		header.node_size = sizeof(geometry::FlatBVHNode);
+		header.bvh_build = uint32_t(build);
+		//the built-in scene has no source and is always the same
+		if (!source.empty())
+		{
+			file_stamp(source, header.source_size, header.source_time);
+		}
+	}
+
+	//path, size and modification time of each file, as strings
+	inline std::vector<std::string> dependency_strings(std::vector<std::string> const& paths)
+	{
+		std::vector<std::string> strings;
+		for (std::string const& path : paths)
+		{
+			uint64_t size;
+			int64_t time;
+			file_stamp(path, size, time);
+			strings.push_back(path);
+			strings.push_back(std::to_string(size));
+			strings.push_back(std::to_string(time));
+		}
+		return strings;
+	}
+
+	//zero terminated, one after the other
+	inline std::vector<char> pack_strings(std::vector<std::string> const& strings)
+	{
+		std::vector<char> packed;
+		for (std::string const& s : strings)
+		{
+			packed.insert(packed.end(), s.begin(), s.end());
+			packed.push_back(0);
+		}
+		return packed;
+	}
+
+	inline std::vector<std::string> unpack_strings(ArrayView<char> const& packed)
+	{
+		std::vector<std::string> strings;
+		for (size_t i = 0; i < packed.size();)
+		{
+			strings.emplace_back(packed.data() + i, strnlen(packed.data() + i, packed.size() - i));
+			i += strings.back().size() + 1;
+		}
+		return strings;
+	}
+
+	inline bool write_section(FILE* file, Section& section, void const* data, size_t element_size, size_t count)
+	{
+		long position = ftell(file);
+		size_t padding = (SECTION_ALIGNMENT - size_t(position) % SECTION_ALIGNMENT) % SECTION_ALIGNMENT;
+		char const zeros[SECTION_ALIGNMENT] = { 0 };
+		if (padding && fwrite(zeros, 1, padding, file) != padding)
+		{
+			return false;
+		}
+		section.offset = uint64_t(position) + padding;
+		section.count = count;
+		return count == 0 || fwrite(data, element_size, count, file) == count;
+	}
+
+	//writes next to the target and renames, so a cache is never seen half written
+	inline bool save(std::string const& path, geometry::Scene const& scene, std::string const& source, geometry::BVHBuild build)
+	{
+		Header header;
+		init_header(header, source, build);
+		std::vector<std::string> setting_strings;
+		for (auto const& setting : scene.settings)
+		{
+			setting_strings.push_back(setting.first);
+			setting_strings.push_back(setting.second);
+		}
+		std::vector<char> settings = pack_strings(setting_strings);
+		std::vector<char> textures = pack_strings(scene.texture_paths);
+		std::vector<std::string> dependency_paths = scene.source_files;
+		dependency_paths.insert(dependency_paths.end(), scene.texture_paths.begin(), scene.texture_paths.end());
+		std::vector<char> dependencies = pack_strings(dependency_strings(dependency_paths));
+
+		std::string temp_path = path + ".tmp";
+		FILE* file = fopen(temp_path.c_str(), "wb");
+		if (!file)
+		{
+			std::cerr << "Could not write scene cache " << path << std::endl;
+			return false;
+		}
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+			write_section(file, header.textures, textures.data(), 1, textures.size()) &&
+			write_section(file, header.materials, scene.material_descs.data(), sizeof(MaterialDesc), scene.material_descs.size()) &&
+			write_section(file, header.spheres, scene.spheres.data(), sizeof(SpherePrimitive), scene.spheres.size()) &&
+			write_section(file, header.vertices, scene.vertices.data(), sizeof(MeshVertex), scene.vertices.size()) &&
+			write_section(file, header.triangles, scene.triangles.data(), sizeof(TrianglePrimitive), scene.triangles.size()) &&
+			write_section(file, header.nodes, scene.bvh.nodes.data(), sizeof(geometry::FlatBVHNode), scene.bvh.nodes.size()) &&
+			write_section(file, header.indices, scene.bvh.indices.data(), sizeof(uint32_t), scene.bvh.indices.size()) &&
+			write_section(file, header.motion, scene.bvh.motion.data(), sizeof(geometry::FlatBVHMotion), scene.bvh.motion.size()) &&
+			write_section(file, header.settings, settings.data(), 1, settings.size()) &&
+			write_section(file, header.dependencies, dependencies.data(), 1, dependencies.size()) &&
+			fseek(file, 0, SEEK_SET) == 0 &&
+			fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = (fclose(file) == 0) && ok;
+		if (ok)
+		{
+			remove(path.c_str());
+			ok = rename(temp_path.c_str(), path.c_str()) == 0;
+		}
+		if (!ok)
+		{
+			remove(temp_path.c_str());
+			std::cerr << "Could not write scene cache " << path << std::endl;
+		}
+		return ok;
+	}
+
+	template <typename T>
+	bool section_view(MappedFile const& file, Section const& section, ArrayView<T>& view)
+	{
+		if (section.offset % SECTION_ALIGNMENT != 0 || section.offset > file.Size() ||
+			section.count > (file.Size() - section.offset) / sizeof(T))
+		{
+			return false;
+		}
+		view = ArrayView<T>(reinterpret_cast<T const*>(file.Data() + section.offset), size_t(section.count));
+		return true;
+	}
+
+	//whether the primitives only refer to vertices and materials the cache has
+	inline bool primitives_valid(ArrayView<SpherePrimitive> const& spheres, ArrayView<MeshVertex> const& vertices,
+		ArrayView<TrianglePrimitive> const& triangles, size_t material_count)
+	{
+		for (SpherePrimitive const& sphere : spheres)
+		{
+			if (sphere.material >= material_count)
+			{
+				return false;
+			}
+		}
+		for (TrianglePrimitive const& triangle : triangles)
+		{
+			if (triangle.v0 >= vertices.size() || triangle.v1 >= vertices.size() || triangle.v2 >= vertices.size() ||
+				triangle.material >= material_count)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//Attaches the cached scene if the cache exists and matches the source and build, returns false otherwise.
+	inline bool load(std::string const& path, std::string const& source, geometry::BVHBuild build, geometry::Scene& scene)
+	{
+		std::unique_ptr<MappedFile> file(new MappedFile());
+		if (!file->Open(path))
+		{
+			return false;
+		}
+		Header expected, header;
+		init_header(expected, source, build);
+		if (file->Size() < sizeof(Header))
+		{
+			std::cerr << "Scene cache " << path << " is truncated, rebuilding" << std::endl;
+			return false;
+		}
+		memcpy(&header, file->Data(), sizeof(header));
+		if (memcmp(&header, &expected, offsetof(Header, textures)) != 0)
+		{
+			std::cerr << "Scene cache " << path << " is out of date, rebuilding" << std::endl;
+			return false;
+		}
+
+		ArrayView<char> textures;
+		ArrayView<MaterialDesc> materials;
+		ArrayView<SpherePrimitive> spheres;
+		ArrayView<MeshVertex> vertices;
+		ArrayView<TrianglePrimitive> triangles;
+		ArrayView<geometry::FlatBVHNode> nodes;
+		ArrayView<uint32_t> indices;
+		ArrayView<geometry::FlatBVHMotion> motion;
+		ArrayView<char> settings;
+		ArrayView<char> dependencies;
+		if (!section_view(*file, header.textures, textures) ||
+			!section_view(*file, header.materials, materials) ||
+			!section_view(*file, header.spheres, spheres) ||
+			!section_view(*file, header.vertices, vertices) ||
+			!section_view(*file, header.triangles, triangles) ||
+			!section_view(*file, header.nodes, nodes) ||
+			!section_view(*file, header.indices, indices) ||
+			!section_view(*file, header.motion, motion) ||
+			!section_view(*file, header.settings, settings) ||
+			!section_view(*file, header.dependencies, dependencies) ||
+			indices.size() != spheres.size() + triangles.size() ||
+			(!motion.empty() && motion.size() != nodes.size()) ||
+			!geometry::FlatBVH::Valid(nodes, indices, indices.size()) ||
+			!primitives_valid(spheres, vertices, triangles, materials.size()))
+		{
+			std::cerr << "Scene cache " << path << " is corrupt, rebuilding" << std::endl;
+			return false;
+		}
+
+		std::vector<std::string> recorded = unpack_strings(dependencies);
+		std::vector<std::string> dependency_paths;
+		for (size_t i = 0; i + 2 < recorded.size(); i += 3)
+		{
+			dependency_paths.push_back(recorded[i]);
+		}
+		if (recorded.size() % 3 != 0 || dependency_strings(dependency_paths) != recorded)
+		{
+			std::cerr << "Scene cache " << path << " is out of date, rebuilding" << std::endl;
+			return false;
+		}
+
+		//textures and materials are few and need their instances anyway
+		for (std::string const& texture : unpack_strings(textures))
+		{
+			if (scene.AddTexture(texture) < 0)
+			{
+				return false;
+			}
+		}
+		for (MaterialDesc const& desc : materials)
+		{
+			scene.AddMaterial(desc);
+		}
+		std::vector<std::string> setting_strings = unpack_strings(settings);
+		for (size_t i = 0; i + 1 < setting_strings.size(); i += 2)
+		{
+			scene.settings.emplace_back(setting_strings[i], setting_strings[i + 1]);
+		}
+		scene.Attach(std::move(file), spheres, vertices, triangles, nodes, indices, motion);
+		return true;
+	}
+}
@@ -0,0 +1,389 @@
+#pragma once
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "ObjLoader.h"
+#include "Scene.h"
+
+using namespace glm;
+
+//Text scene format, one statement per line, '#' starts a comment:
+//
+//  texture <name> <path>             image, relative to the scene file
+//  material <name> lambertian r g b [texture]
+//  material <name> metal r g b fuzz [texture]
+//  material <name> dielectric ior
+//  material <name> light r g b        emissive, spheres with it are sampled as lights
+//  sphere x y z radius <material> [dx dy dz]   moves by d over the scene's time, for motion blur
+//  vertex x y z
+//  triangle i j k <material>          indices into the vertices so far, negative counts back from the last one
+//  mesh <path.obj> [material]         relative to the scene file; the material replaces the MTL ones
+//  camera position|lookat|up x y z
+//  camera fov|aperture|focus-distance value
+//  environment <path>                 HDR sky, relative to the scene file
+namespace scene_file
+{
+	//Walks the file in place, no per-line strings are made
+	struct Cursor
+	{
+		char const* p;
+		int line;
+
+		void SkipSpace()
+		{
+			while (*p == ' ' || *p == '\t' || *p == '\r')
+			{
+				++p;
+			}
+		}
+
+		bool AtLineEnd()
+		{
+			SkipSpace();
+			return *p == '\n' || *p == '#' || *p == 0;
+		}
+
+		void NextLine()
+		{
+			while (*p && *p != '\n')
+			{
+				++p;
+			}
+			if (*p)
+			{
+				++p;
+			}
+			++line;
+		}
+
+		bool Word(std::string& out)
+		{
+			if (AtLineEnd())
+			{
+				return false;
+			}
+			char const* begin = p;
+			while (*p && !isspace((unsigned char)*p) && *p != '#')
+			{
+				++p;
+			}
+			out.assign(begin, p);
+			return true;
+		}
+
+		//rest of the line, for paths with spaces
+		bool Rest(std::string& out)
+		{
+			if (AtLineEnd())
+			{
+				return false;
+			}
+			char const* begin = p;
+			while (*p && *p != '\n' && *p != '#')
+			{
+				++p;
+			}
+			char const* end = p;
+			while (end > begin && isspace((unsigned char)end[-1]))
+			{
+				--end;
+			}
+			out.assign(begin, end);
+			return true;
+		}
+
+		bool Float(float& out)
+		{
+			//strtof skips newlines, which would run into the next statement
+			if (AtLineEnd())
+			{
+				return false;
+			}
+			char* end;
+			out = strtof(p, &end);
+			//strtof also takes inf, nan and values out of float range
+			if (end == p || !std::isfinite(out))
+			{
+				return false;
+			}
+			p = end;
+			return true;
+		}
+
+		bool Int(long& out)
+		{
+			if (AtLineEnd())
+			{
+				return false;
+			}
+			char* end;
+			out = strtol(p, &end, 10);
+			if (end == p)
+			{
+				return false;
+			}
+			p = end;
+			return true;
+		}
+
+		bool Vec3(vec3& out)
+		{
+			return Float(out.x) && Float(out.y) && Float(out.z);
+		}
+	};
+
+	inline bool read_file(std::string const& path, std::string& contents)
+	{
+		FILE* file = fopen(path.c_str(), "rb");
+		if (!file)
+		{
+			return false;
+		}
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		contents.resize(size_t(glm::max(size, 0L)));
+		size_t read = contents.empty() ? 0 : fread(&contents[0], 1, contents.size(), file);
+		fclose(file);
+		return read == contents.size();
+	}
+
+	//enough digits to read back the same float, where std::to_string would round small values to 0
+	inline std::string float_value(float f)
+	{
+		char text[32];
+		snprintf(text, sizeof(text), "%.9g", f);
+		return text;
+	}
+
+	inline std::string vec3_value(vec3 const& v)
+	{
+		return float_value(v.x) + "," + float_value(v.y) + "," + float_value(v.z);
+	}
+
+	//Appends the file's materials and primitives to the scene. The BVH is left to the caller.
+	inline bool load(std::string const& path, geometry::Scene& scene)
+	{
+		std::string contents;
+		if (!read_file(path, contents))
+		{
+			std::cerr << "Could not open scene " << path << std::endl;
+			return false;
+		}
+
+		std::unordered_map<std::string, uint32_t> materials;
+		std::unordered_map<std::string, int32_t> textures;
+		//scene vertex index of each vertex in this file
+		std::vector<uint32_t> vertices;
+		std::string keyword, name, last_name;
+		uint32_t last_material = 0;
+
+		//primitives mostly come in runs with the same material, so skip the lookup for those
+		auto find_material = [&](Cursor& cursor, uint32_t& material) -> bool
+		{
+			if (!cursor.Word(name))
+			{
+				return false;
+			}
+			if (name != last_name)
+			{
+				auto found = materials.find(name);
+				if (found == materials.end())
+				{
+					std::cerr << path << ":" << cursor.line << ": unknown material '" << name << "'" << std::endl;
+					return false;
+				}
+				last_name = name;
+				last_material = found->second;
+			}
+			material = last_material;
+			return true;
+		};
+
+		//optional texture name at the end of a material
+		auto find_texture = [&](Cursor& cursor, int32_t& texture) -> bool
+		{
+			std::string texture_name;
+			if (!cursor.Word(texture_name))
+			{
+				return true;
+			}
+			auto found = textures.find(texture_name);
+			if (found == textures.end())
+			{
+				std::cerr << path << ":" << cursor.line << ": unknown texture '" << texture_name << "'" << std::endl;
+				return false;
+			}
+			texture = found->second;
+			return true;
+		};
+
+		auto vertex = [&](long index, uint32_t& out) -> bool
+		{
+			long i = (index < 0) ? long(vertices.size()) + index : index;
+			if (i < 0 || i >= long(vertices.size()))
+			{
+				return false;
+			}
+			out = vertices[i];
+			return true;
+		};
+
+		Cursor cursor{ contents.c_str(), 1 };
+		for (; *cursor.p; cursor.NextLine())
+		{
+			if (!cursor.Word(keyword))
+			{
+				continue;
+			}
+
+			bool ok;
+			if (keyword == "sphere")
+			{
+				vec3 center, motion(0);
+				float radius;
+				uint32_t material;
+				ok = cursor.Vec3(center) && cursor.Float(radius) && find_material(cursor, material) &&
+					(cursor.AtLineEnd() || cursor.Vec3(motion));
+				if (ok)
+				{
+					scene.AddSphere(center, radius, material, motion);
+				}
+			}
+			else if (keyword == "vertex")
+			{
+				MeshVertex v{ vec3(0), vec3(0), vec2(0) };
+				ok = cursor.Vec3(v.position);
+				vertices.push_back(scene.AddVertex(v));
+			}
+			else if (keyword == "triangle")
+			{
+				long i0, i1, i2;
+				uint32_t v0, v1, v2;
+				uint32_t material;
+				ok = cursor.Int(i0) && cursor.Int(i1) && cursor.Int(i2) &&
+					vertex(i0, v0) && vertex(i1, v1) && vertex(i2, v2) && find_material(cursor, material);
+				if (ok)
+				{
+					scene.AddTriangle(v0, v1, v2, material);
+				}
+			}
+			else if (keyword == "mesh")
+			{
+				std::string mesh;
+				uint32_t material = obj::NO_MATERIAL;
+				ok = cursor.Word(mesh) && (cursor.AtLineEnd() || find_material(cursor, material));
+				if (ok && !obj::load(obj::resolve_path(path, mesh), scene, material))
+				{
+					return false;
+				}
+			}
+			else if (keyword == "texture")
+			{
+				std::string image;
+				ok = cursor.Word(name) && cursor.Rest(image);
+				if (ok)
+				{
+					int32_t texture = scene.AddTexture(obj::resolve_path(path, image));
+					if (texture < 0)
+					{
+						return false;
+					}
+					textures[name] = texture;
+				}
+			}
+			else if (keyword == "material")
+			{
+				std::string type;
+				MaterialDesc desc{ MaterialType::Lambertian, vec3(0), 0.f };
+				ok = cursor.Word(name) && cursor.Word(type);
+				if (ok && type == "lambertian")
+				{
+					ok = cursor.Vec3(desc.color) && find_texture(cursor, desc.texture);
+				}
+				else if (ok && type == "metal")
+				{
+					desc.type = MaterialType::Metal;
+					ok = cursor.Vec3(desc.color) && cursor.Float(desc.parameter) && find_texture(cursor, desc.texture);
+				}
+				else if (ok && type == "dielectric")
+				{
+					desc.type = MaterialType::Dielectric;
+					ok = cursor.Float(desc.parameter);
+				}
+				else if (ok && type == "light")
+				{
+					desc.type = MaterialType::Light;
+					ok = cursor.Vec3(desc.color);
+				}
+				else
+				{
+					ok = false;
+				}
+				if (ok)
+				{
+					materials[name] = scene.AddMaterial(desc);
+					//a redefinition replaces the old one for everything that follows
+					last_name.clear();
+				}
+			}
+			else if (keyword == "camera")
+			{
+				std::string key;
+				ok = cursor.Word(key);
+				if (ok && (key == "position" || key == "lookat" || key == "up"))
+				{
+					vec3 v;
+					ok = cursor.Vec3(v);
+					if (ok)
+					{
+						scene.settings.emplace_back("camera-" + key, vec3_value(v));
+					}
+				}
+				else if (ok && (key == "fov" || key == "aperture" || key == "focus-distance"))
+				{
+					float v;
+					ok = cursor.Float(v);
+					if (ok)
+					{
+						scene.settings.emplace_back(key, float_value(v));
+					}
+				}
+				else
+				{
+					ok = false;
+				}
+			}
+			else if (keyword == "environment")
+			{
+				std::string environment;
+				ok = cursor.Rest(environment);
+				if (ok)
+				{
+					scene.settings.emplace_back("environment", obj::resolve_path(path, environment));
+				}
+			}
+			else
+			{
+				std::cerr << path << ":" << cursor.line << ": unknown statement '" << keyword << "'" << std::endl;
+				return false;
+			}
+
+			if (!ok || !cursor.AtLineEnd())
+			{
+				std::cerr << path << ":" << cursor.line << ": malformed '" << keyword << "'" << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,276 @@
+#include "Server.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+#include "Socket.h"
+
+namespace server
+{
+	//FNV-1a of the scene file and what the BVH is built with
+	static bool scene_hash(RenderSettings const& settings, uint64_t& hash)
+	{
+		hash = 14695981039346656037ull;
+		auto mix = [&hash](void const* data, size_t size)
+		{
+			unsigned char const* bytes = static_cast<unsigned char const*>(data);
+			for (size_t i = 0; i < size; ++i)
+			{
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+			}
+		};
+		uint32_t build = uint32_t(settings.bvh);
+		mix(&build, sizeof(build));
+		//the built-in scene has no file
+		mix(settings.scene.data(), settings.scene.size());
+		if (settings.scene.empty())
+		{
+			return true;
+		}
+		std::ifstream file(settings.scene, std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+		std::vector<char> buffer(size_t(1) << 16);
+		while (file.read(buffer.data(), std::streamsize(buffer.size())) || file.gcount() > 0)
+		{
+			mix(buffer.data(), size_t(file.gcount()));
+		}
+		return true;
+	}
+
+	//What a request may set: how the frame looks and where it goes. Process-wide settings (threads,
+	//kernels, tracing, caches) stay the server's, and other modes or config files are never started from a request.
+	static bool request_key(std::string const& key)
+	{
+		static char const* const KEYS[] = { "width", "height", "spp", "depth", "seed", "sampler", "bvh", "tile-size",
+			"output", "aovs", "denoise", "filter", "filter-radius", "scene", "scene-cache", "heatmap", "environment",
+			"camera-position", "camera-lookat", "camera-up", "fov", "aperture", "focus-distance",
+			"shutter-open", "shutter-close", "temporal", "region" };
+		for (char const* allowed : KEYS)
+		{
+			if (key == allowed)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	class Server
+	{
+	public:
+		//base is args parsed
+		Server(std::vector<std::string> const& args, RenderSettings const& base, RenderFunction const& render) :
+			args(args), render(render), base(base)
+		{
+		}
+
+		bool Quit() const { return quit; }
+		RenderSettings const& Base() const { return base; }
+
+		//the answer to one request line, empty for blank lines
+		std::string Handle(std::string const& line)
+		{
+			typedef std::chrono::high_resolution_clock clock;
+			std::stringstream tokens(line);
+			std::vector<std::string> request_args = args;
+			std::string token;
+			while (tokens >> token)
+			{
+				if (token == "quit")
+				{
+					quit = true;
+					return "ok quit";
+				}
+				size_t equals = token.find('=');
+				if (equals == std::string::npos)
+				{
+					return "error expected key=value, got '" + token + "'";
+				}
+				if (!request_key(token.substr(0, equals)))
+				{
+					return "error '" + token.substr(0, equals) + "' can't be set per request";
+				}
+				request_args.push_back("--" + token);
+			}
+			if (request_args.size() == args.size())
+			{
+				return "";
+			}
+
+			RenderSettings settings;
+			if (!config::parse_command_line(settings, request_args))
+			{
+				return "error bad settings";
+			}
+			uint64_t hash;
+			if (!scene_hash(settings, hash))
+			{
+				return "error could not read " + settings.scene;
+			}
+
+			clock::time_point start = clock::now();
+			char const* found = "resident";
+			Resident* resident = Find(hash);
+			if (!resident)
+			{
+				std::unique_ptr<rt::Renderer> renderer(new rt::Renderer(settings));
+				srand(unsigned(settings.seed));
+				if (!renderer->LoadScene())
+				{
+					return "error could not load " + settings.scene;
+				}
+				if (residents.size() >= size_t(base.resident_scenes))
+				{
+					Evict();
+				}
+				residents.push_back(Resident{ hash, std::move(renderer), 0 });
+				resident = &residents.back();
+				found = "loaded";
+			}
+			resident->last_used = ++requests;
+
+			//as on the command line: the scene's settings, then the server's and the request's over them
+			rt::Renderer& renderer = *resident->renderer;
+			renderer.Settings() = settings;
+			if (!renderer.World().settings.empty())
+			{
+				for (auto const& setting : renderer.World().settings)
+				{
+					if (!config::apply(renderer.Settings(), setting.first, setting.second))
+					{
+						return "error bad scene settings";
+					}
+				}
+				if (!config::parse_command_line(renderer.Settings(), request_args))
+				{
+					return "error bad settings";
+				}
+			}
+			srand(unsigned(settings.seed));
+			renderer.ResetStats();
+			if (!render(renderer, request_args))
+			{
+				return "error render failed";
+			}
+			std::chrono::duration<double> seconds = clock::now() - start;
+			std::stringstream answer;
+			answer << "ok " << seconds.count() << "s " << found;
+			return answer.str();
+		}
+
+	private:
+		struct Resident
+		{
+			uint64_t hash;
+			std::unique_ptr<rt::Renderer> renderer;
+			uint64_t last_used;
+		};
+
+		Resident* Find(uint64_t hash)
+		{
+			for (Resident& resident : residents)
+			{
+				if (resident.hash == hash)
+				{
+					return &resident;
+				}
+			}
+			return nullptr;
+		}
+
+		//the least recently used scene
+		void Evict()
+		{
+			size_t oldest = 0;
+			for (size_t i = 1; i < residents.size(); ++i)
+			{
+				if (residents[i].last_used < residents[oldest].last_used)
+				{
+					oldest = i;
+				}
+			}
+			residents.erase(residents.begin() + oldest);
+		}
+
+		std::vector<std::string> args;
+		RenderFunction render;
+		RenderSettings base;
+		std::vector<Resident> residents;
+		uint64_t requests{ 0 };
+		bool quit{ false };
+	};
+
+	int serve(std::string const& address, std::vector<std::string> const& args, RenderFunction const& render)
+	{
+		RenderSettings base;
+		if (!config::parse_command_line(base, args))
+		{
+			return 1;
+		}
+		Server server(args, base, render);
+		if (address == "-")
+		{
+			std::ostream answers(std::cout.rdbuf());
+			std::streambuf* out = std::cout.rdbuf(std::cerr.rdbuf());
+			std::string line;
+			while (!server.Quit() && std::getline(std::cin, line))
+			{
+				std::string answer = server.Handle(line);
+				if (!answer.empty())
+				{
+					answers << answer << std::endl;
+				}
+			}
+			std::cout.rdbuf(out);
+			return 0;
+		}
+
+		if (!server.Base().serve_remote && !net::local(address))
+		{
+			std::cerr << "Not serving on " << address << ": other hosts could reach it, only unix:/path and loopback"
+				" addresses are allowed without serve-remote" << std::endl;
+			return 1;
+		}
+		net::Socket listener = net::listen(address);
+		if (!listener.Valid())
+		{
+			std::cerr << "Could not listen on " << address << std::endl;
+			return 1;
+		}
+		std::cout << "server: listening on " << address << std::endl;
+		while (!server.Quit())
+		{
+			net::Socket client = listener.Accept();
+			std::string received;
+			char chunk[4096];
+			while (client.Valid() && !server.Quit())
+			{
+				size_t newline = received.find('\n');
+				if (newline == std::string::npos)
+				{
+					int size = client.ReceiveSome(chunk, sizeof(chunk));
+					if (size <= 0)
+					{
+						break;
+					}
+					received.append(chunk, size_t(size));
+					continue;
+				}
+				std::string answer = server.Handle(received.substr(0, newline));
+				received.erase(0, newline + 1);
+				if (!answer.empty() && !client.SendAll((answer + "\n").data(), answer.size() + 1))
+				{
+					break;
+				}
+			}
+		}
+		return 0;
+	}
+}
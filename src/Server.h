@@ -0,0 +1,28 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Renderer.h"
+
+//Long-running renderer (rt --serve unix:/path, host:port or - for stdin) that keeps scenes loaded
+//with their BVH, so a request only pays for tracing.
+//A request is one line of whitespace separated key=value settings, as on the command line:
+//	scene=room.scene camera-position=1,2,3 spp=16 region=0,0,128,128 output=thumb.png
+//applied over the server's own command line; only settings of the frame itself are accepted, not threads,
+//kernels, caches or other modes. The answer is one line, "ok <seconds>s <how the scene was found>"
+//or "error <reason>"; "quit" stops the server. Scenes are kept by a hash of the scene file's contents and
+//path and the BVH build, so an edited file is loaded again (files it refers to are not hashed); the least
+//recently used is dropped beyond settings.resident_scenes. Over a socket, clients are served one at a time.
+//Anyone who can connect can make the server read and write files, so TCP addresses other hosts can reach
+//(":port" or a public interface) are refused unless settings.serve_remote is set.
+//With stdin the answers go to stdout and everything the renderer prints to stderr.
+namespace server
+{
+	//renders with a renderer whose settings are those of the request; args is the request as a command line
+	typedef std::function<bool(rt::Renderer& renderer, std::vector<std::string> const& args)> RenderFunction;
+
+	//args is the server's own command line, program name first. Returns the exit code.
+	int serve(std::string const& address, std::vector<std::string> const& args, RenderFunction const& render);
+}
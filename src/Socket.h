@@ -0,0 +1,337 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+//Blocking stream sockets, just enough for the render coordinator and its workers (see Distributed.h)
+//and the render server (see Server.h).
+//Addresses are "host:port" for TCP (":port" listens on all interfaces) or "unix:/path" for a
+//Unix domain socket, which Windows builds don't support. Nothing is authenticated.
+namespace net
+{
+#ifdef _WIN32
+	typedef SOCKET Handle;
+	Handle const INVALID = INVALID_SOCKET;
+	inline void close_handle(Handle handle) { closesocket(handle); }
+	inline int poll_handles(pollfd* fds, size_t count, int timeout_ms) { return WSAPoll(fds, ULONG(count), timeout_ms); }
+#else
+	typedef int Handle;
+	Handle const INVALID = -1;
+	inline void close_handle(Handle handle) { close(handle); }
+	inline int poll_handles(pollfd* fds, size_t count, int timeout_ms) { return poll(fds, nfds_t(count), timeout_ms); }
+#endif
+
+	//once per process before the first socket, a no-op outside Windows
+	inline bool startup()
+	{
+#ifdef _WIN32
+		static bool started = false;
+		if (!started)
+		{
+			WSADATA data;
+			started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		}
+		return started;
+#else
+		return true;
+#endif
+	}
+
+	class Socket
+	{
+	public:
+		Socket() {}
+		explicit Socket(Handle handle) : handle(handle)
+		{
+#ifdef SO_NOSIGPIPE
+			int on = 1;
+			setsockopt(handle, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+		}
+		~Socket() { Close(); }
+		Socket(Socket&& other) : handle(other.handle) { other.handle = INVALID; }
+		Socket& operator=(Socket&& other)
+		{
+			if (this != &other)
+			{
+				Close();
+				handle = other.handle;
+				other.handle = INVALID;
+			}
+			return *this;
+		}
+		Socket(Socket const&) = delete;
+		Socket& operator=(Socket const&) = delete;
+
+		bool Valid() const { return handle != INVALID; }
+		Handle Native() const { return handle; }
+
+		void Close()
+		{
+			if (handle != INVALID)
+			{
+				close_handle(handle);
+				handle = INVALID;
+			}
+		}
+
+		//invalid if the listening socket failed
+		Socket Accept()
+		{
+			Socket socket(accept(handle, nullptr, nullptr));
+			socket.SetNoDelay();
+			return socket;
+		}
+
+		//Messages go out right away instead of waiting to be batched with the next. Without this a
+		//short request following a result sits out a delayed ACK. Fails harmlessly on Unix domain sockets.
+		void SetNoDelay()
+		{
+			int on = 1;
+			setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&on), sizeof(on));
+		}
+
+		//a receive that waits longer than this fails, 0 waits forever
+		void SetReceiveTimeout(int seconds)
+		{
+#ifdef _WIN32
+			DWORD ms = DWORD(seconds) * 1000;
+			setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<char const*>(&ms), sizeof(ms));
+#else
+			timeval tv{ seconds, 0 };
+			setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+		}
+
+		bool SendAll(void const* data, size_t size)
+		{
+#ifdef MSG_NOSIGNAL
+			int const flags = MSG_NOSIGNAL; //a closed peer is an error, not a SIGPIPE
+#else
+			int const flags = 0;
+#endif
+			char const* p = static_cast<char const*>(data);
+			while (size > 0)
+			{
+				auto sent = send(handle, p, int(size), flags);
+				if (sent <= 0)
+				{
+					return false;
+				}
+				p += sent;
+				size -= size_t(sent);
+			}
+			return true;
+		}
+
+		//whatever has arrived, at least one byte; 0 or less when the peer is gone
+		int ReceiveSome(void* data, size_t size)
+		{
+			return int(recv(handle, static_cast<char*>(data), int(size), 0));
+		}
+
+		bool ReceiveAll(void* data, size_t size)
+		{
+			char* p = static_cast<char*>(data);
+			while (size > 0)
+			{
+				auto received = recv(handle, p, int(size), 0);
+				if (received <= 0)
+				{
+					return false;
+				}
+				p += received;
+				size -= size_t(received);
+			}
+			return true;
+		}
+
+		//Messages are a type and a size, both 32 bit, followed by the payload.
+		//Everything is in the sender's byte order; all machines involved are little endian.
+		bool Send(uint32_t type, std::vector<char> const& payload)
+		{
+			uint32_t header[2] = { type, uint32_t(payload.size()) };
+			return SendAll(header, sizeof(header)) && (payload.empty() || SendAll(payload.data(), payload.size()));
+		}
+
+		bool Receive(uint32_t& type, std::vector<char>& payload, size_t max_size = size_t(1) << 28)
+		{
+			uint32_t header[2];
+			if (!ReceiveAll(header, sizeof(header)) || header[1] > max_size)
+			{
+				return false;
+			}
+			type = header[0];
+			payload.resize(header[1]);
+			return payload.empty() || ReceiveAll(payload.data(), payload.size());
+		}
+
+	private:
+		Handle handle{ INVALID };
+	};
+
+	//resolved socket address, TCP or Unix domain
+	struct Address
+	{
+		sockaddr_storage storage;
+		socklen_t length{ 0 };
+		int family{ AF_UNSPEC };
+		std::string path; //Unix domain sockets only
+	};
+
+	inline bool resolve(std::string const& text, bool passive, Address& out)
+	{
+		out = Address();
+		memset(&out.storage, 0, sizeof(out.storage));
+		if (text.compare(0, 5, "unix:") == 0)
+		{
+#ifdef _WIN32
+			return false;
+#else
+			sockaddr_un* address = reinterpret_cast<sockaddr_un*>(&out.storage);
+			out.path = text.substr(5);
+			if (out.path.empty() || out.path.size() >= sizeof(address->sun_path))
+			{
+				return false;
+			}
+			address->sun_family = AF_UNIX;
+			memcpy(address->sun_path, out.path.c_str(), out.path.size() + 1);
+			out.length = socklen_t(sizeof(sockaddr_un));
+			out.family = AF_UNIX;
+			return true;
+#endif
+		}
+		size_t colon = text.find_last_of(':');
+		if (colon == std::string::npos)
+		{
+			return false;
+		}
+		std::string host = text.substr(0, colon), port = text.substr(colon + 1);
+		//IPv6 hosts come in brackets, "[::1]:port"
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+		{
+			host = host.substr(1, host.size() - 2);
+		}
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = passive ? AI_PASSIVE : 0;
+		addrinfo* found = nullptr;
+		if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0 || !found)
+		{
+			return false;
+		}
+		memcpy(&out.storage, found->ai_addr, found->ai_addrlen);
+		out.length = socklen_t(found->ai_addrlen);
+		out.family = found->ai_family;
+		freeaddrinfo(found);
+		return true;
+	}
+
+	//whether only this machine can reach the address: Unix domain sockets and loopback interfaces
+	inline bool local(std::string const& address_text)
+	{
+		Address address;
+		if (!startup() || !resolve(address_text, true, address))
+		{
+			return false;
+		}
+		if (address.family == AF_INET)
+		{
+			uint32_t ip = ntohl(reinterpret_cast<sockaddr_in const*>(&address.storage)->sin_addr.s_addr);
+			return (ip >> 24) == 127;
+		}
+		if (address.family == AF_INET6)
+		{
+			in6_addr const& ip = reinterpret_cast<sockaddr_in6 const*>(&address.storage)->sin6_addr;
+			return IN6_IS_ADDR_LOOPBACK(&ip) || (IN6_IS_ADDR_V4MAPPED(&ip) && ip.s6_addr[12] == 127);
+		}
+		return address.family == AF_UNIX;
+	}
+
+	//invalid socket if the address doesn't resolve or is taken
+	inline Socket listen(std::string const& address_text, int backlog = 64)
+	{
+		Address address;
+		if (!startup() || !resolve(address_text, true, address))
+		{
+			return Socket();
+		}
+		Socket socket(::socket(address.family, SOCK_STREAM, 0));
+		if (!socket.Valid())
+		{
+			return Socket();
+		}
+#ifndef _WIN32
+		if (address.family == AF_UNIX)
+		{
+			//Left behind by an earlier coordinator or server if nobody answers on it. Anything but a
+			//socket there is not ours to delete, and neither is a socket another process listens on.
+			struct stat info;
+			if (lstat(address.path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+			{
+				Socket probe(::socket(AF_UNIX, SOCK_STREAM, 0));
+				bool refused = probe.Valid() &&
+					::connect(probe.Native(), reinterpret_cast<sockaddr const*>(&address.storage), address.length) != 0 &&
+					errno == ECONNREFUSED;
+				if (!refused)
+				{
+					std::cerr << "Address in use: " << address_text << std::endl;
+					return Socket();
+				}
+				unlink(address.path.c_str());
+			}
+		}
+		else
+#endif
+		{
+			int on = 1;
+			setsockopt(socket.Native(), SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char const*>(&on), sizeof(on));
+		}
+		if (bind(socket.Native(), reinterpret_cast<sockaddr const*>(&address.storage), address.length) != 0
+			|| ::listen(socket.Native(), backlog) != 0)
+		{
+			return Socket();
+		}
+		return socket;
+	}
+
+	inline Socket connect(std::string const& address_text)
+	{
+		Address address;
+		if (!startup() || !resolve(address_text, false, address))
+		{
+			return Socket();
+		}
+		Socket socket(::socket(address.family, SOCK_STREAM, 0));
+		if (!socket.Valid() || ::connect(socket.Native(), reinterpret_cast<sockaddr const*>(&address.storage), address.length) != 0)
+		{
+			return Socket();
+		}
+		socket.SetNoDelay();
+		return socket;
+	}
+}
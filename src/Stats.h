@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include <omp.h>
+
+#include <3rdparty/glm/glm.hpp>
+
+//Traversal statistics, to tell BVH quality from material cost and sample count.
+//On by default in debug builds; release builds (NDEBUG) only have them with RT_STATS=1,
+//otherwise the STAT_ macros expand to nothing and none of this is touched.
+#ifndef RT_STATS
+#ifdef NDEBUG
+#define RT_STATS 0
+#else
+#define RT_STATS 1
+#endif
+#endif
+
+namespace stats
+{
+	enum class Counter
+	{
+		NodeVisits,
+		BoxTests, //FlatBVH nodes and AABB::Intersect
+		PrimitiveTests,
+		PrimitiveHits,
+		Count
+	};
+
+	//paths longer than this land in the last bin
+	int const DEPTH_BINS = 16;
+
+	inline char const* Name(Counter counter)
+	{
+		switch (counter)
+		{
+		case Counter::NodeVisits: return "node visits";
+		case Counter::BoxTests: return "box tests";
+		case Counter::PrimitiveTests: return "primitive tests";
+		case Counter::PrimitiveHits: return "primitive hits";
+		default: return "";
+		}
+	}
+
+	//Counters per thread, each in its own cache line, summed after rendering.
+	//The heatmap holds the node visits and primitive tests per sample of every pixel.
+	class Stats
+	{
+	public:
+		Stats() { Reset(0, 0); }
+
+		void Reset(int width, int height)
+		{
+			slots.assign(size_t(omp_get_max_threads()), Slot());
+			heatmap_size = glm::ivec2(width, height);
+			heatmap.assign(size_t(width) * height, 0.f);
+		}
+
+		void Add(Counter counter, uint64_t n = 1)
+		{
+			Slot* slot = ThreadSlot();
+			if (slot)
+			{
+				slot->counts[int(counter)] += n;
+			}
+		}
+
+		//depth is the number of bounces before the path ended
+		void AddPathEnd(int depth)
+		{
+			Slot* slot = ThreadSlot();
+			if (slot)
+			{
+				++slot->depths[glm::min(depth, DEPTH_BINS - 1)];
+			}
+		}
+
+		//traversal work done by the calling thread so far
+		uint64_t ThreadCost()
+		{
+			Slot* slot = ThreadSlot();
+			return slot ? slot->counts[int(Counter::NodeVisits)] + slot->counts[int(Counter::PrimitiveTests)] : 0;
+		}
+
+		//each pixel is sampled by one thread at a time, so no locking
+		void SetPixelCost(glm::ivec2 const& pos, float cost)
+		{
+			if (pos.x >= 0 && pos.y >= 0 && pos.x < heatmap_size.x && pos.y < heatmap_size.y)
+			{
+				heatmap[size_t(pos.y) * heatmap_size.x + pos.x] = cost;
+			}
+		}
+
+		uint64_t Total(Counter counter) const
+		{
+			uint64_t total = 0;
+			for (Slot const& slot : slots)
+			{
+				total += slot.counts[int(counter)];
+			}
+			return total;
+		}
+
+		uint64_t PathsEndingAt(int depth) const
+		{
+			uint64_t total = 0;
+			for (Slot const& slot : slots)
+			{
+				total += slot.depths[depth];
+			}
+			return total;
+		}
+
+		//averages per traced ray, then how many paths ended after each number of bounces
+		void Print(std::ostream& out, uint64_t rays) const
+		{
+			double per_ray = 1.0 / double(rays > 0 ? rays : 1);
+			out << "stats per ray:";
+			for (int counter = 0; counter < int(Counter::Count); ++counter)
+			{
+				out << (counter ? ", " : " ") << Total(Counter(counter)) * per_ray << " " << Name(Counter(counter));
+			}
+			out << std::endl << "path depths:";
+			for (int depth = 0; depth < DEPTH_BINS; ++depth)
+			{
+				if (PathsEndingAt(depth) > 0)
+				{
+					out << " " << depth << (depth == DEPTH_BINS - 1 ? "+: " : ": ") << PathsEndingAt(depth);
+				}
+			}
+			out << std::endl;
+		}
+
+		glm::ivec2 HeatmapSize() const { return heatmap_size; }
+		std::vector<float> const& Heatmap() const { return heatmap; }
+
+		//cold to hot through blue, green and red, scaled to the most expensive pixel
+		void HeatmapToRGB8(unsigned char* rgb) const
+		{
+			float max_cost = 0;
+			for (float cost : heatmap)
+			{
+				max_cost = glm::max(max_cost, cost);
+			}
+			for (size_t i = 0; i < heatmap.size(); ++i)
+			{
+				float x = (max_cost > 0) ? heatmap[i] / max_cost : 0.f;
+				glm::vec3 c = glm::clamp(glm::vec3(2 * x - 1, 1 - glm::abs(2 * x - 1), 1 - 2 * x), 0.f, 1.f);
+				rgb[3 * i + 0] = (unsigned char)(c.r * 255.f + 0.5f);
+				rgb[3 * i + 1] = (unsigned char)(c.g * 255.f + 0.5f);
+				rgb[3 * i + 2] = (unsigned char)(c.b * 255.f + 0.5f);
+			}
+		}
+
+	private:
+		struct alignas(64) Slot
+		{
+			uint64_t counts[int(Counter::Count)]{};
+			uint64_t depths[DEPTH_BINS]{};
+		};
+
+		Slot* ThreadSlot()
+		{
+			size_t thread = size_t(omp_get_thread_num());
+			return thread < slots.size() ? &slots[thread] : nullptr;
+		}
+
+		std::vector<Slot> slots;
+		glm::ivec2 heatmap_size;
+		std::vector<float> heatmap;
+	};
+
+	inline Stats& get()
+	{
+		static Stats instance;
+		return instance;
+	}
+}
+
+#if RT_STATS
+#define STAT_ADD(counter) stats::get().Add(stats::Counter::counter)
+#define STAT_ADD_N(counter, n) stats::get().Add(stats::Counter::counter, n)
+#define STAT_PATH_END(depth) stats::get().AddPathEnd(depth)
+#else
+#define STAT_ADD(counter) ((void)0)
+#define STAT_ADD_N(counter, n) ((void)0)
+#define STAT_PATH_END(depth) ((void)0)
+#endif
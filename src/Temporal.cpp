@@ -0,0 +1,130 @@
+#include "Temporal.h"
+
+#include <cfloat>
+#include <cmath>
+#include <limits>
+
+#include "Renderer.h"
+#include "rt_math.h"
+
+namespace rt
+{
+	//whether everything but the camera that goes into a pixel's color is the same, so history still applies
+	static bool same_shading(RenderSettings const& a, RenderSettings const& b)
+	{
+		return a.scene == b.scene && a.environment == b.environment && a.samples == b.samples &&
+			a.max_depth == b.max_depth && a.sampler == b.sampler && a.filter == b.filter &&
+			a.filter_radius == b.filter_radius && a.shutter_open == b.shutter_open && a.shutter_close == b.shutter_close;
+	}
+
+	std::vector<int> TemporalCache::Plan(RenderSettings const& current, Film const& film)
+	{
+		int const w = film.Width(), h = film.Height();
+		std::vector<int> samples(size_t(w) * h, current.samples);
+		history.assign(size_t(w) * h, vec4(0));
+		history_disagreement.assign(size_t(w) * h, 0.f);
+		reused = 0;
+		if (!radiance.empty() && !same_shading(settings, current))
+		{
+			Clear();
+		}
+		if (radiance.empty() || width != w || height != h)
+		{
+			return samples;
+		}
+
+		Camera previous_camera = make_camera(settings, film);
+		Camera camera = make_camera(current, film);
+		std::vector<float> nearest(size_t(w) * h, std::numeric_limits<float>::infinity());
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				size_t i = size_t(y) * w + x;
+				if (radiance[i].a <= 0)
+				{
+					continue;
+				}
+				//the sky is infinitely far away and only ever fills what no surface reaches
+				bool sky = std::isinf(depth[i]);
+				vec3 point = sky ? camera.location + previous_camera.pinhole_direction(vec2(x, y) + 0.5f) :
+					previous_camera.unproject(vec2(x, y) + 0.5f, depth[i]);
+				vec2 pos;
+				if (!camera.project(point, pos))
+				{
+					continue;
+				}
+				ivec2 pixel = ivec2(floor(pos));
+				if (pixel.x < 0 || pixel.y < 0 || pixel.x >= w || pixel.y >= h)
+				{
+					continue;
+				}
+				size_t j = size_t(pixel.y) * w + pixel.x;
+				float distance = sky ? FLT_MAX : length(point - camera.location);
+				if (distance < nearest[j])
+				{
+					nearest[j] = distance;
+					history[j] = radiance[i];
+					history_disagreement[j] = disagreement[i];
+				}
+			}
+		}
+
+		int const reused_samples = max(1, int(current.samples * REUSED_SAMPLES));
+		for (size_t i = 0; i < samples.size(); ++i)
+		{
+			if (history[i].a > 0 && history_disagreement[i] <= DISAGREEMENT)
+			{
+				samples[i] = reused_samples;
+				++reused;
+			}
+		}
+		return samples;
+	}
+
+	void TemporalCache::Resolve(RenderSettings const& current, Film const& fresh, AOVBuffers const& aovs, Film& film)
+	{
+		int const w = film.Width(), h = film.Height();
+		Camera camera = make_camera(current, film);
+		radiance.resize(size_t(w) * h);
+		depth.resize(size_t(w) * h);
+		disagreement.resize(size_t(w) * h);
+		for (int y = 0; y < h; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				size_t i = size_t(y) * w + x;
+				ivec2 pos(x, y);
+				vec4 added = fresh.Get(pos);
+				vec4 const& past = history[i];
+				film.AddSum(pos, added);
+				if (past.a > 0)
+				{
+					film.Add(pos, vec3(past), past.a * HISTORY_DECAY);
+				}
+				//how far the new samples are from what history said; nothing to compare to means they stand alone
+				disagreement[i] = 0;
+				if (past.a > 0 && added.a > 0)
+				{
+					float now = luminance(vec3(added) / added.a), before = luminance(vec3(past));
+					disagreement[i] = std::abs(now - before) / max(max(now, before), 1e-3f);
+				}
+				radiance[i] = vec4(film.Resolve(pos), film.Get(pos).a);
+				//A lens spreads what a pixel sees over a disc around its center ray, so the hit goes back onto
+				//that ray at its view depth rather than where it was
+				depth[i] = std::isinf(aovs.Depth(pos)) ? aovs.Depth(pos) : camera.view_depth(aovs.Position(pos));
+			}
+		}
+		settings = current;
+		width = w;
+		height = h;
+	}
+
+	void TemporalCache::Clear()
+	{
+		radiance.clear();
+		depth.clear();
+		disagreement.clear();
+		width = height = 0;
+	}
+}
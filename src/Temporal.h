@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+
+#include "AOV.h"
+#include "Config.h"
+#include "Film.h"
+
+using namespace glm;
+
+namespace rt
+{
+	//History for camera sequences over static geometry (settings.temporal).
+	//Before a frame, the previous one is reprojected: every pixel goes back to the point at its first
+	//hit's view depth on the ray through its center and forward into the new view, the nearest surface
+	//winning where several land, and the sky following by direction alone. View depth rather than ray
+	//length, since with a lens the hits aren't on the center ray. Pixels that get history need fewer new
+	//samples; those that don't (disocclusions, the image border, the first frame) and those where history
+	//and new samples disagreed last time (noise, or shading that changes with the view) get settings.samples.
+	//History counts for a bit less every frame, so reused pixels settle at about a full frame's worth
+	//of samples and view dependent shading can't lag behind for long.
+	class TemporalCache
+	{
+	public:
+		//a reused pixel gets this fraction of settings.samples, at least one
+		static float constexpr REUSED_SAMPLES = 0.25f;
+		//history weight kept per frame; with REUSED_SAMPLES, reused pixels converge to settings.samples worth of weight
+		static float constexpr HISTORY_DECAY = 0.75f;
+		//relative difference between new samples and history above which a pixel is fully sampled next frame
+		static float constexpr DISAGREEMENT = 0.2f;
+
+		//Reprojects the previous frame into the view of settings. Returns the samples to trace per pixel,
+		//all settings.samples if there is no usable history. Settings that change shading rather than the
+		//view (scene, sky, samples, depth, sampler, filter, shutter) clear the history.
+		std::vector<int> Plan(RenderSettings const& settings, Film const& film);
+
+		//adds the new samples and the reprojected history into film, and keeps the result (with the
+		//first hits from aovs) as history for the next frame
+		void Resolve(RenderSettings const& settings, Film const& fresh, AOVBuffers const& aovs, Film& film);
+
+		//forgets the history, for when the scene changes
+		void Clear();
+
+		//pixels of the last frame that had history
+		size_t Reused() const { return reused; }
+
+	private:
+		//last frame
+		RenderSettings settings;
+		int width{ 0 }, height{ 0 };
+		std::vector<vec4> radiance; //resolved color and weight
+		std::vector<float> depth; //view depth of the nearest first hit, infinite for the sky
+		std::vector<float> disagreement;
+
+		//last frame seen from the current one, color and weight; zero weight where nothing landed
+		std::vector<vec4> history;
+		std::vector<float> history_disagreement;
+		size_t reused{ 0 };
+	};
+}
@@ -0,0 +1,464 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <3rdparty/glm/glm.hpp>
+#include <3rdparty/stb_image.h>
+
+#include "Trace.h"
+
+using namespace glm;
+
+//Texels are stored in square tiles, 8-bit sRGB on disk and linear float once cached
+int const TEXTURE_TILE_SIZE = 32;
+
+inline float srgb_to_linear(uint8_t value)
+{
+	static float const* table = []()
+	{
+		static float t[256];
+		for (int i = 0; i < 256; ++i)
+		{
+			float c = i / 255.f;
+			t[i] = (c <= 0.04045f) ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+		}
+		return t;
+	}();
+	return table[value];
+}
+
+inline uint8_t linear_to_srgb(float value)
+{
+	float c = glm::clamp(value, 0.f, 1.f);
+	c = (c <= 0.0031308f) ? c * 12.92f : 1.055f * pow(c, 1.f / 2.4f) - 0.055f;
+	return uint8_t(c * 255.f + 0.5f);
+}
+
+//Mip pyramid of an image, cut into tiles and written to <image>.tiles next to the source, so
+//only the tiles that are actually sampled are ever read back. The file is reused while it matches
+//the source's size and modification time. If it can't be written the tiles stay in memory.
+class TiledImage
+{
+public:
+	static int const TILE_BYTES = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 4;
+
+	struct Level
+	{
+		int width, height;
+		int tiles_x, tiles_y;
+		uint32_t first_tile;
+	};
+
+	~TiledImage()
+	{
+		if (file)
+		{
+			fclose(file);
+		}
+	}
+
+	bool Open(std::string const& path)
+	{
+		std::string tiled_path = path + ".tiles";
+		Header expected;
+		if (!SourceHeader(path, expected))
+		{
+			std::cerr << "Could not open texture " << path << std::endl;
+			return false;
+		}
+		if (OpenTiled(tiled_path, expected))
+		{
+			return true;
+		}
+		return Convert(path, tiled_path, expected);
+	}
+
+	//reads one tile's RGBA bytes, safe to call from any thread
+	void ReadTile(uint32_t tile, uint8_t* out) const
+	{
+		if (!file)
+		{
+			memcpy(out, memory.data() + size_t(tile) * TILE_BYTES, TILE_BYTES);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(file_mutex);
+		fseek(file, long(data_offset + uint64_t(tile) * TILE_BYTES), SEEK_SET);
+		if (fread(out, 1, TILE_BYTES, file) != size_t(TILE_BYTES))
+		{
+			memset(out, 0, TILE_BYTES);
+		}
+	}
+
+	std::vector<Level> const& Levels() const
+	{
+		return levels;
+	}
+
+private:
+	static uint32_t const VERSION = 1;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t tile_size;
+		uint64_t source_size;
+		int64_t source_time;
+	};
+
+	static bool SourceHeader(std::string const& path, Header& header)
+	{
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+		{
+			return false;
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "RTTILES", 8);
+		header.version = VERSION;
+		header.tile_size = TEXTURE_TILE_SIZE;
+		header.source_size = uint64_t(info.st_size);
+		header.source_time = int64_t(info.st_mtime);
+		return true;
+	}
+
+	static std::vector<Level> MakeLevels(int width, int height)
+	{
+		std::vector<Level> out;
+		uint32_t tiles = 0;
+		while (true)
+		{
+			Level level;
+			level.width = width;
+			level.height = height;
+			level.tiles_x = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+			level.tiles_y = (height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+			level.first_tile = tiles;
+			tiles += uint32_t(level.tiles_x * level.tiles_y);
+			out.push_back(level);
+			if (width == 1 && height == 1)
+			{
+				return out;
+			}
+			width = glm::max(1, width / 2);
+			height = glm::max(1, height / 2);
+		}
+	}
+
+	bool OpenTiled(std::string const& tiled_path, Header const& expected)
+	{
+		FILE* f = fopen(tiled_path.c_str(), "rb");
+		if (!f)
+		{
+			return false;
+		}
+		Header header;
+		int32_t size[2];
+		if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(&header, &expected, sizeof(header)) != 0 ||
+			fread(size, sizeof(size), 1, f) != 1 || size[0] <= 0 || size[1] <= 0)
+		{
+			fclose(f);
+			return false;
+		}
+		//a truncated file would read past its end for the smaller levels
+		std::vector<Level> tiled_levels = MakeLevels(size[0], size[1]);
+		Level const& last = tiled_levels.back();
+		uint64_t expected_size = sizeof(Header) + sizeof(size) + uint64_t(last.first_tile + last.tiles_x * last.tiles_y) * TILE_BYTES;
+		if (fseek(f, 0, SEEK_END) != 0 || ftell(f) < 0 || uint64_t(ftell(f)) != expected_size)
+		{
+			fclose(f);
+			return false;
+		}
+		levels = tiled_levels;
+		file = f;
+		data_offset = sizeof(Header) + sizeof(size);
+		return true;
+	}
+
+	//decodes the image, builds the mip levels in linear space and writes them out tile by tile
+	bool Convert(std::string const& path, std::string const& tiled_path, Header const& header)
+	{
+		int width, height, channels;
+		uint8_t* pixels = stbi_load(path.c_str(), &width, &height, &channels, 4);
+		if (!pixels)
+		{
+			std::cerr << "Could not load texture " << path << ": " << stbi_failure_reason() << std::endl;
+			return false;
+		}
+		levels = MakeLevels(width, height);
+		Level const& last = levels.back();
+		memory.assign(size_t(last.first_tile + last.tiles_x * last.tiles_y) * TILE_BYTES, 0);
+
+		std::vector<vec4> level_pixels(size_t(width) * height);
+		for (size_t i = 0; i < level_pixels.size(); ++i)
+		{
+			uint8_t const* p = pixels + 4 * i;
+			level_pixels[i] = vec4(srgb_to_linear(p[0]), srgb_to_linear(p[1]), srgb_to_linear(p[2]), p[3] / 255.f);
+		}
+		stbi_image_free(pixels);
+
+		for (size_t l = 0; l < levels.size(); ++l)
+		{
+			Level const& level = levels[l];
+			if (l > 0)
+			{
+				//2x2 box filter, clamped at odd edges
+				Level const& previous = levels[l - 1];
+				std::vector<vec4> next(size_t(level.width) * level.height);
+				for (int y = 0; y < level.height; ++y)
+				{
+					for (int x = 0; x < level.width; ++x)
+					{
+						int x0 = glm::min(2 * x, previous.width - 1), x1 = glm::min(2 * x + 1, previous.width - 1);
+						int y0 = glm::min(2 * y, previous.height - 1), y1 = glm::min(2 * y + 1, previous.height - 1);
+						next[size_t(y) * level.width + x] = 0.25f * (
+							level_pixels[size_t(y0) * previous.width + x0] + level_pixels[size_t(y0) * previous.width + x1] +
+							level_pixels[size_t(y1) * previous.width + x0] + level_pixels[size_t(y1) * previous.width + x1]);
+					}
+				}
+				level_pixels.swap(next);
+			}
+			for (int ty = 0; ty < level.tiles_y; ++ty)
+			{
+				for (int tx = 0; tx < level.tiles_x; ++tx)
+				{
+					uint8_t* tile = memory.data() + size_t(level.first_tile + ty * level.tiles_x + tx) * TILE_BYTES;
+					for (int j = 0; j < TEXTURE_TILE_SIZE; ++j)
+					{
+						for (int i = 0; i < TEXTURE_TILE_SIZE; ++i)
+						{
+							//partial tiles repeat the edge
+							int x = glm::min(tx * TEXTURE_TILE_SIZE + i, level.width - 1);
+							int y = glm::min(ty * TEXTURE_TILE_SIZE + j, level.height - 1);
+							vec4 const& c = level_pixels[size_t(y) * level.width + x];
+							uint8_t* out = tile + 4 * (j * TEXTURE_TILE_SIZE + i);
+							out[0] = linear_to_srgb(c.r);
+							out[1] = linear_to_srgb(c.g);
+							out[2] = linear_to_srgb(c.b);
+							out[3] = uint8_t(glm::clamp(c.a, 0.f, 1.f) * 255.f + 0.5f);
+						}
+					}
+				}
+			}
+		}
+
+		//written next to the target and renamed, so another process never opens a half written file
+		std::string temp_path = tiled_path + ".tmp";
+		FILE* f = fopen(temp_path.c_str(), "wb");
+		int32_t size[2] = { width, height };
+		bool written = f && fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(size, sizeof(size), 1, f) == 1 &&
+			fwrite(memory.data(), 1, memory.size(), f) == memory.size();
+		if (f && fclose(f) != 0)
+		{
+			written = false;
+		}
+		if (written)
+		{
+			remove(tiled_path.c_str());
+			written = rename(temp_path.c_str(), tiled_path.c_str()) == 0;
+		}
+		if (!written)
+		{
+			remove(temp_path.c_str());
+		}
+		else if (OpenTiled(tiled_path, header))
+		{
+			std::vector<uint8_t>().swap(memory);
+		}
+		else
+		{
+			remove(tiled_path.c_str());
+		}
+		return true;
+	}
+
+	std::vector<Level> levels;
+	FILE* file{ nullptr };
+	uint64_t data_offset{ 0 };
+	mutable std::mutex file_mutex;
+	std::vector<uint8_t> memory; //only when the tiled file couldn't be written
+};
+
+//Decoded tiles of all textures, evicted least recently used first once over budget.
+//Split into independently locked shards so threads sampling different tiles rarely meet.
+//Tiles are handed out by shared_ptr, so a tile evicted while a thread still reads it stays alive.
+class TextureCache
+{
+public:
+	struct Tile
+	{
+		vec3 texels[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE];
+	};
+	typedef std::shared_ptr<Tile const> TilePtr;
+
+	TextureCache(size_t budget_bytes = DEFAULT_BUDGET)
+	{
+		SetBudget(budget_bytes);
+	}
+
+	void SetBudget(size_t budget_bytes)
+	{
+		for (Shard& shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.capacity = glm::max(size_t(1), budget_bytes / sizeof(Tile) / SHARDS);
+		}
+	}
+
+	int Register(TiledImage const* image)
+	{
+		std::lock_guard<std::mutex> lock(images_mutex);
+		images.push_back(image);
+		return int(images.size() - 1);
+	}
+
+	TilePtr Get(int image, uint32_t tile)
+	{
+		uint64_t key = (uint64_t(image) << 40) | tile;
+		Shard& shard = shards[(key ^ (key >> 7) ^ (uint64_t(image) * 0x9e3779b1u)) % SHARDS];
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto found = shard.tiles.find(key);
+			if (found != shard.tiles.end())
+			{
+				shard.lru.splice(shard.lru.begin(), shard.lru, found->second.second);
+				++hits;
+				return found->second.first;
+			}
+		}
+
+		//read and decode without holding the shard
+		TRACE_SCOPE("texture tile", "tile", tile);
+		uint8_t bytes[TiledImage::TILE_BYTES];
+		TiledImage const* source;
+		{
+			std::lock_guard<std::mutex> lock(images_mutex);
+			source = images[image];
+		}
+		source->ReadTile(tile, bytes);
+		std::shared_ptr<Tile> decoded = std::make_shared<Tile>();
+		for (int i = 0; i < TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE; ++i)
+		{
+			decoded->texels[i] = vec3(srgb_to_linear(bytes[4 * i]), srgb_to_linear(bytes[4 * i + 1]), srgb_to_linear(bytes[4 * i + 2]));
+		}
+		++misses;
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.tiles.find(key);
+		if (found != shard.tiles.end())
+		{
+			//another thread was faster
+			return found->second.first;
+		}
+		while (shard.tiles.size() >= shard.capacity)
+		{
+			shard.tiles.erase(shard.lru.back());
+			shard.lru.pop_back();
+		}
+		shard.lru.push_front(key);
+		shard.tiles.emplace(key, std::make_pair(TilePtr(decoded), shard.lru.begin()));
+		return decoded;
+	}
+
+	uint64_t Hits() const { return hits; }
+	uint64_t Misses() const { return misses; }
+
+	static size_t const DEFAULT_BUDGET = size_t(256) << 20;
+
+private:
+	static int const SHARDS = 16;
+
+	struct Shard
+	{
+		std::mutex mutex;
+		std::list<uint64_t> lru; //most recent first
+		std::unordered_map<uint64_t, std::pair<TilePtr, std::list<uint64_t>::iterator> > tiles;
+		size_t capacity{ 1 };
+	};
+
+	Shard shards[SHARDS];
+	std::mutex images_mutex;
+	std::vector<TiledImage const*> images;
+	std::atomic<uint64_t> hits{ 0 }, misses{ 0 };
+};
+
+//Image texture, repeating, sampled trilinearly between the two mip levels that match the footprint
+class Texture
+{
+public:
+	Texture(TextureCache& cache) : cache(cache) {}
+
+	bool Load(std::string const& path)
+	{
+		if (!image.Open(path))
+		{
+			return false;
+		}
+		id = cache.Register(&image);
+		return true;
+	}
+
+	//footprint is the size of the area to average over, in uv units; 0 samples the full resolution
+	vec3 Sample(vec2 const& uv, float footprint) const
+	{
+		std::vector<TiledImage::Level> const& levels = image.Levels();
+		TiledImage::Level const& base = levels[0];
+		float lod = log2(glm::max(footprint * float(glm::max(base.width, base.height)), 1e-8f));
+		lod = glm::clamp(lod, 0.f, float(levels.size() - 1));
+		int level = int(lod);
+		float t = lod - level;
+		vec3 c = Bilinear(level, uv);
+		if (t > 0 && level + 1 < int(levels.size()))
+		{
+			c = mix(c, Bilinear(level + 1, uv), t);
+		}
+		return c;
+	}
+
+private:
+	vec3 Bilinear(int level_index, vec2 const& uv) const
+	{
+		TiledImage::Level const& level = image.Levels()[level_index];
+		//v points up, rows are stored top down
+		float x = (uv.x - floor(uv.x)) * level.width - 0.5f;
+		float y = (1.f - (uv.y - floor(uv.y))) * level.height - 0.5f;
+		int x0 = int(floor(x)), y0 = int(floor(y));
+		float fx = x - x0, fy = y - y0;
+
+		//the four texels mostly share one tile, so keep the last one around
+		uint32_t current_tile = 0xffffffff;
+		TextureCache::TilePtr tile;
+		auto texel = [&](int px, int py) -> vec3
+		{
+			px = (px % level.width + level.width) % level.width;
+			py = (py % level.height + level.height) % level.height;
+			uint32_t index = level.first_tile + uint32_t((py / TEXTURE_TILE_SIZE) * level.tiles_x + px / TEXTURE_TILE_SIZE);
+			if (index != current_tile)
+			{
+				tile = cache.Get(id, index);
+				current_tile = index;
+			}
+			return tile->texels[(py % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + px % TEXTURE_TILE_SIZE];
+		};
+		vec3 top = mix(texel(x0, y0), texel(x0 + 1, y0), fx);
+		vec3 bottom = mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx);
+		return mix(top, bottom, fy);
+	}
+
+	TextureCache& cache;
+	TiledImage image;
+	int id{ -1 };
+};
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+//Timeline of scoped events in the Chrome trace format, for chrome://tracing or Perfetto.
+//Each thread records into its own ring buffer, keeping its latest events if it fills up,
+//and everything is written out when the program exits. Until Start is called a scope
+//costs one branch.
+namespace tracing
+{
+	typedef std::chrono::steady_clock clock;
+
+	//names are string literals, only their pointers are kept
+	struct Event
+	{
+		char const* name;
+		char const* arg_name; //null if there is no argument
+		int64_t arg;
+		int64_t start_ns, end_ns;
+	};
+
+	class Tracer
+	{
+	public:
+		//events per thread before the oldest are overwritten
+		static size_t const DEFAULT_CAPACITY = size_t(1) << 16;
+
+		void Start(std::string const& trace_path, size_t capacity = DEFAULT_CAPACITY)
+		{
+			path = trace_path;
+			rings.assign(size_t(omp_get_max_threads()), Ring());
+			for (Ring& ring : rings)
+			{
+				ring.events.resize(capacity);
+			}
+			origin = clock::now();
+			if (!enabled)
+			{
+				std::atexit([]() { get().Write(); });
+			}
+			enabled = true;
+		}
+
+		bool Enabled() const { return enabled; }
+
+		int64_t Now() const
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - origin).count();
+		}
+
+		void Record(Event const& event)
+		{
+			size_t thread = size_t(omp_get_thread_num());
+			if (thread >= rings.size())
+			{
+				return;
+			}
+			Ring& ring = rings[thread];
+			ring.events[ring.recorded % ring.events.size()] = event;
+			++ring.recorded;
+		}
+
+		//once, at exit; events still open by then are lost
+		void Write()
+		{
+			if (!enabled)
+			{
+				return;
+			}
+			enabled = false;
+			FILE* file = fopen(path.c_str(), "w");
+			if (!file)
+			{
+				std::cerr << "Could not write trace " << path << std::endl;
+				return;
+			}
+			fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+			bool first = true;
+			for (size_t thread = 0; thread < rings.size(); ++thread)
+			{
+				Ring const& ring = rings[thread];
+				if (ring.recorded == 0)
+				{
+					continue;
+				}
+				fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s %zu\"}}",
+					first ? "" : ",\n", thread, thread ? "worker" : "main", thread);
+				first = false;
+				size_t capacity = ring.events.size();
+				size_t begin = (ring.recorded > capacity) ? size_t(ring.recorded - capacity) : 0;
+				for (size_t i = begin; i < ring.recorded; ++i)
+				{
+					Event const& e = ring.events[i % capacity];
+					fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f",
+						e.name, thread, e.start_ns * 1e-3, (e.end_ns - e.start_ns) * 1e-3);
+					if (e.arg_name)
+					{
+						fprintf(file, ",\"args\":{\"%s\":%lld}", e.arg_name, (long long)e.arg);
+					}
+					fprintf(file, "}");
+				}
+			}
+			fprintf(file, "\n]}\n");
+			if (fclose(file) != 0)
+			{
+				std::cerr << "Could not write trace " << path << std::endl;
+			}
+		}
+
+		static Tracer& get()
+		{
+			static Tracer instance;
+			return instance;
+		}
+
+	private:
+		struct alignas(64) Ring
+		{
+			std::vector<Event> events;
+			size_t recorded{ 0 };
+		};
+
+		bool enabled{ false };
+		std::string path;
+		clock::time_point origin;
+		std::vector<Ring> rings;
+	};
+
+	//records its lifetime as one event
+	class Scope
+	{
+	public:
+		explicit Scope(char const* name, char const* arg_name = nullptr, int64_t arg = 0)
+		{
+			Tracer& tracer = Tracer::get();
+			if (tracer.Enabled())
+			{
+				event = Event{ name, arg_name, arg, tracer.Now(), 0 };
+				active = true;
+			}
+		}
+
+		~Scope()
+		{
+			Tracer& tracer = Tracer::get();
+			if (active && tracer.Enabled())
+			{
+				event.end_ns = tracer.Now();
+				tracer.Record(event);
+			}
+		}
+
+		Scope(Scope const&) = delete;
+		Scope& operator=(Scope const&) = delete;
+
+	private:
+		Event event;
+		bool active{ false };
+	};
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+//TRACE_SCOPE("name") or TRACE_SCOPE("name", "arg", value) times the rest of the enclosing block
+#define TRACE_SCOPE(...) tracing::Scope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
@@ -3,11 +3,12 @@
 #include <algorithm>
 #include <memory>
 
-#include <3rdparty\glm\glm.hpp>
+#include <3rdparty/glm/glm.hpp>
 
 #include "rt_math.h"
 #include "Material.h"
 #include "ray.h"
+#include "Stats.h"
 
 using namespace glm;
 using std::shared_ptr;
@@ -32,8 +33,20 @@ namespace geometry
 			return AABB(glm::min(other.min__, min__), glm::max(other.max__, max__));
 		}
 
+		float SurfaceArea() const
+		{
+			vec3 d = max__ - min__;
+			return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+		}
+
+		vec3 Center() const
+		{
+			return (min__ + max__) * 0.5f;
+		}
+
 		bool Intersect(Ray const& ray, vec2 t_range) const
 		{
+			STAT_ADD(BoxTests);
 			vec3 inv_d = 1.f / ray.direction;
 			vec3 t_min = (min__ - ray.origin) * inv_d;
 			vec3 t_max = (max__ - ray.origin) * inv_d;
@@ -111,12 +124,20 @@ namespace geometry
 		std::vector<shared_ptr<Hitable> > list;
 	};
 
+	enum class BVHBuild
+	{
+		Median, //split at the median, cycling through the axes
+		SAH //binned surface area heuristic
+	};
+
 	class BVHNode : public Hitable
 	{
 	public:
-		BVHNode(HitableList& list) : BVHNode(list.list.begin(), list.list.end(), 0) {}
+		typedef std::vector<shared_ptr<Hitable> >::iterator iterator;
+
+		BVHNode(HitableList& list, BVHBuild build = BVHBuild::Median) : BVHNode(list.list.begin(), list.list.end(), 0, build) {}
 
-		BVHNode(std::vector<shared_ptr<Hitable> >::iterator begin, std::vector<shared_ptr<Hitable> >::iterator end, uint depth)
+		BVHNode(iterator begin, iterator end, uint depth, BVHBuild build = BVHBuild::Median)
 		{
 			if (end - begin == 0)
 			{
@@ -136,6 +157,19 @@ namespace geometry
 				return;
 			}
 
+			if (build == BVHBuild::SAH)
+			{
+				iterator mid = SAHSplit(begin, end);
+				if (mid != begin && mid != end)
+				{
+					left = std::make_shared<BVHNode>(begin, mid, depth + 1, build);
+					right = std::make_shared<BVHNode>(mid, end, depth + 1, build);
+					bounds = left->Bounds().Union(right->Bounds());
+					return;
+				}
+				//no useful split, fall back to the median
+			}
+
 			auto cmp_x = [](shared_ptr<Hitable> & a, shared_ptr<Hitable> & b) -> bool 
 			{ return a->Bounds().min__.x < b->Bounds().min__.x; };
 			auto cmp_y = [](shared_ptr<Hitable> & a, shared_ptr<Hitable> & b) -> bool 
@@ -158,8 +192,8 @@ namespace geometry
 				break;
 			}
 
-			left = std::make_shared<BVHNode>(begin, begin + ((end - begin) / 2), depth + 1);
-			right = std::make_shared<BVHNode>(begin + ((end - begin) / 2) , end, depth + 1);
+			left = std::make_shared<BVHNode>(begin, begin + ((end - begin) / 2), depth + 1, build);
+			right = std::make_shared<BVHNode>(begin + ((end - begin) / 2) , end, depth + 1, build);
 			bounds = left->Bounds().Union(right->Bounds());
 		}
 
@@ -196,6 +230,77 @@ namespace geometry
 		}
 		
 	private:
+
+		//Buckets the centroids along their widest axis and partitions at the bucket boundary
+		//that minimizes area * count on both sides.
+		static iterator SAHSplit(iterator begin, iterator end)
+		{
+			int const BINS = 12;
+			vec3 c_min = (*begin)->Bounds().Center(), c_max = c_min;
+			for (iterator it = begin; it != end; ++it)
+			{
+				vec3 c = (*it)->Bounds().Center();
+				c_min = glm::min(c_min, c);
+				c_max = glm::max(c_max, c);
+			}
+			vec3 extent = c_max - c_min;
+			int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : ((extent.y > extent.z) ? 1 : 2);
+			if (extent[axis] <= 0)
+			{
+				return begin;
+			}
+
+			auto bin_of = [&](shared_ptr<Hitable> const& h) -> int
+			{
+				//NaN fails the comparison and lands in the first bin
+				float bin = (h->Bounds().Center()[axis] - c_min[axis]) / extent[axis] * BINS;
+				return (bin > 0) ? int(glm::min(bin, float(BINS - 1))) : 0;
+			};
+
+			AABB bin_bounds[BINS];
+			int counts[BINS] = { 0 };
+			for (iterator it = begin; it != end; ++it)
+			{
+				int b = bin_of(*it);
+				bin_bounds[b] = counts[b] ? bin_bounds[b].Union((*it)->Bounds()) : (*it)->Bounds();
+				++counts[b];
+			}
+
+			//sweep from the right to get the cost of every split position
+			float right_cost[BINS];
+			AABB accumulated;
+			int count = 0;
+			for (int b = BINS - 1; b > 0; --b)
+			{
+				if (counts[b])
+				{
+					accumulated = count ? accumulated.Union(bin_bounds[b]) : bin_bounds[b];
+					count += counts[b];
+				}
+				right_cost[b] = count ? accumulated.SurfaceArea() * count : 0.f;
+			}
+
+			int best_split = -1;
+			float best_cost = FLT_MAX;
+			count = 0;
+			for (int b = 0; b < BINS - 1; ++b)
+			{
+				if (counts[b])
+				{
+					accumulated = count ? accumulated.Union(bin_bounds[b]) : bin_bounds[b];
+					count += counts[b];
+				}
+				float cost = (count ? accumulated.SurfaceArea() * count : 0.f) + right_cost[b + 1];
+				if (count && cost < best_cost)
+				{
+					best_cost = cost;
+					best_split = b;
+				}
+			}
+
+			return std::partition(begin, end, [&](shared_ptr<Hitable> const& h) { return bin_of(h) <= best_split; });
+		}
+
 		AABB bounds;
 		shared_ptr<Hitable> left, right;
 	};
@@ -234,7 +339,8 @@ namespace geometry
 					rec.t = t;
 					rec.point = ray.At(rec.t);
 					rec.normal = Normal(rec.point);
-					rec.mat = material;
+					rec.mat = material.get();
+					rec.light_sampled = true;
 					return true;
 
 				}
@@ -244,10 +350,12 @@ namespace geometry
 					rec.t = t;
 					rec.point = ray.At(rec.t);
 					rec.normal = Normal(rec.point);
-					rec.mat = material;
+					rec.mat = material.get();
+					rec.light_sampled = true;
 					return true;
 				}
 			}
+			return false;
 		}
 
 		vec3 Normal(vec3 const& surface_point) const
@@ -255,6 +363,27 @@ namespace geometry
 			return (surface_point - center) / radius;
 		}
 
+		//Picks a direction from 'from' towards the part of the sphere visible from it.
+		//pdf is per unit solid angle.
+		bool SampleDirection(vec3 const& from, vec2 const& u, vec3& direction, float& pdf) const
+		{
+			vec3 to_center = center - from;
+			float dist2 = dot(to_center, to_center);
+			if (dist2 <= radius * radius)
+			{
+				return false;
+			}
+			float cos_max = sqrt(glm::max(0.f, 1.f - radius * radius / dist2));
+			direction = sample_in_cone(to_center / sqrt(dist2), cos_max, u);
+			pdf = 1.f / (glm::two_pi<float>() * (1.f - cos_max));
+			return true;
+		}
+
+		float Area() const
+		{
+			return 2.f * glm::two_pi<float>() * radius * radius;
+		}
+
 		vec3 center;
 		float radius;
 	};
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <3rdparty/glm/glm.hpp>
+#include <3rdparty/glm/gtc/constants.hpp>
+
+#include "rt_math.h"
+#include "geometry.h"
+
+using namespace glm;
+
+namespace geometry
+{
+	//Set of directions around an axis, used to bound where a group of lights emits
+	struct DirectionCone
+	{
+		vec3 axis{ 0, 0, 1 };
+		float theta_o{ pi<float>() }; //spread of the normals
+		float theta_e{ half_pi<float>() }; //spread of the emission around each normal
+
+		DirectionCone Union(DirectionCone const& other) const
+		{
+			float theta_e_union = glm::max(theta_e, other.theta_e);
+			//make sure 'this' is the wider cone
+			if (other.theta_o > theta_o)
+			{
+				DirectionCone out = other.Union(*this);
+				return out;
+			}
+			float theta_d = acos(clamp(dot(axis, other.axis), -1.f, 1.f));
+			if (glm::min(theta_d + other.theta_o, pi<float>()) <= theta_o)
+			{
+				return DirectionCone{ axis, theta_o, theta_e_union };
+			}
+			float theta = (theta_o + theta_d + other.theta_o) * 0.5f;
+			if (theta >= pi<float>())
+			{
+				return DirectionCone{ axis, pi<float>(), theta_e_union };
+			}
+			//rotate our axis towards the other one until both cones fit
+			float theta_r = theta - theta_o;
+			vec3 rotation_axis = cross(axis, other.axis);
+			if (dot(rotation_axis, rotation_axis) < 1e-12f)
+			{
+				return DirectionCone{ axis, pi<float>(), theta_e_union };
+			}
+			rotation_axis = normalize(rotation_axis);
+			vec3 side = cross(rotation_axis, axis);
+			vec3 new_axis = axis * cos(theta_r) + side * sin(theta_r);
+			return DirectionCone{ normalize(new_axis), theta, theta_e_union };
+		}
+	};
+
+	//Light hierarchy over the emissive spheres of a scene.
+	//Each node bounds position, power and emission direction of its lights, so a light
+	//can be picked proportionally to its estimated contribution in O(log n).
+	class LightBVH
+	{
+	public:
+		//takes the emissive spheres of a scene, see Scene::Lights
+		LightBVH(std::vector<Sphere> emitters) : lights(std::move(emitters))
+		{
+			std::vector<int> indices(lights.size());
+			for (int i = 0; i < int(indices.size()); ++i)
+			{
+				indices[i] = i;
+			}
+			if (!indices.empty())
+			{
+				nodes.reserve(2 * indices.size());
+				Build(indices.begin(), indices.end(), 0);
+			}
+		}
+
+		bool Empty() const
+		{
+			return lights.empty();
+		}
+
+		Sphere const& Light(int index) const
+		{
+			return lights[index];
+		}
+
+		//Stochastic traversal: descends into each child with probability proportional to its importance.
+		//'normal' may be zero for points that receive light from all directions.
+		bool Sample(vec3 const& point, vec3 const& normal, float u, int& light, float& pmf) const
+		{
+			if (nodes.empty())
+			{
+				return false;
+			}
+			pmf = 1.f;
+			int node_index = 0;
+			while (true)
+			{
+				Node const& node = nodes[node_index];
+				if (node.light >= 0)
+				{
+					light = node.light;
+					return (Importance(node, point, normal) > 0);
+				}
+				float importance_l = Importance(nodes[node_index + 1], point, normal);
+				float importance_r = Importance(nodes[node.right], point, normal);
+				if (importance_l + importance_r <= 0)
+				{
+					return false;
+				}
+				float p_l = importance_l / (importance_l + importance_r);
+				if (u < p_l)
+				{
+					pmf *= p_l;
+					u = glm::min(u / p_l, 1.f - FLT_EPSILON);
+					node_index = node_index + 1;
+				}
+				else
+				{
+					pmf *= 1.f - p_l;
+					u = glm::min((u - p_l) / (1.f - p_l), 1.f - FLT_EPSILON);
+					node_index = node.right;
+				}
+			}
+		}
+
+	private:
+
+		//left child always follows its parent, so only the right one is stored
+		struct Node
+		{
+			AABB bounds;
+			DirectionCone cone;
+			float power;
+			int right{ -1 };
+			int light{ -1 };
+		};
+
+		int Build(std::vector<int>::iterator begin, std::vector<int>::iterator end, uint depth)
+		{
+			int index = int(nodes.size());
+			nodes.emplace_back();
+			if (end - begin == 1)
+			{
+				Sphere const& sphere = lights[*begin];
+				Node& leaf = nodes[index];
+				leaf.bounds = sphere.Bounds();
+				//a sphere emits in every direction
+				leaf.cone = DirectionCone();
+				leaf.power = luminance(sphere.material->Emitted()) * sphere.Area() * pi<float>();
+				leaf.light = *begin;
+				return index;
+			}
+
+			auto center = [this](int i, int axis) -> float
+			{ return lights[i].center[axis]; };
+			int axis = depth % 3;
+			std::nth_element(begin, begin + (end - begin) / 2, end,
+				[&](int a, int b) -> bool { return center(a, axis) < center(b, axis); });
+
+			Build(begin, begin + (end - begin) / 2, depth + 1);
+			int right = Build(begin + (end - begin) / 2, end, depth + 1);
+
+			//nodes may have been reallocated by the recursion
+			Node const& l = nodes[index + 1];
+			Node const& r = nodes[right];
+			Node& node = nodes[index];
+			node.bounds = l.bounds.Union(r.bounds);
+			node.cone = l.cone.Union(r.cone);
+			node.power = l.power + r.power;
+			node.right = right;
+			return index;
+		}
+
+		float Importance(Node const& node, vec3 const& point, vec3 const& normal) const
+		{
+			vec3 center = (node.bounds.min__ + node.bounds.max__) * 0.5f;
+			vec3 to_point = point - center;
+			float dist2 = dot(to_point, to_point);
+			float radius2 = dot(node.bounds.max__ - center, node.bounds.max__ - center);
+			//avoid the singularity when the point is close to or inside the bounds
+			dist2 = glm::max(dist2, sqrt(radius2) * 0.5f);
+
+			if (dist2 <= radius2)
+			{
+				return node.power / dist2;
+			}
+			vec3 wi = normalize(to_point);
+			float theta_b = asin(sqrt(radius2 / dist2));
+
+			//angle between the emission axis and the point, minus all the slack we have
+			float theta_w = acos(clamp(dot(node.cone.axis, wi), -1.f, 1.f));
+			float theta_p = glm::max(0.f, theta_w - node.cone.theta_o - theta_b);
+			if (theta_p >= node.cone.theta_e)
+			{
+				return 0;
+			}
+			float importance = node.power * cos(theta_p) / dist2;
+
+			if (normal != vec3(0))
+			{
+				float theta_i = acos(clamp(dot(normal, -wi), -1.f, 1.f));
+				float theta_ip = glm::max(0.f, theta_i - theta_b);
+				if (theta_ip >= half_pi<float>())
+				{
+					return 0;
+				}
+				importance *= cos(theta_ip);
+			}
+			return glm::max(importance, 0.f);
+		}
+
+		std::vector<Node> nodes;
+		std::vector<Sphere> lights;
+	};
+}
@@ -1,7 +1,8 @@
 #pragma once
+#include <cmath>
 #include <iostream>
 #include <memory>
-#include <3rdparty/glm/vec3.hpp>
+#include <3rdparty/glm/glm.hpp>
 using glm::vec3;
 
 class Material;
@@ -9,12 +10,19 @@ class Material;
 class Ray
 {
 public:
-	Ray(vec3 const& origin, vec3 const& direction) : origin(origin), direction(direction) {}
-	
+	Ray(vec3 const& origin, vec3 const& direction, float time = 0) : origin(origin), direction(direction), time(time) {}
+
 	vec3 At(float t) const { return origin + t * direction; }
 
 	vec3 origin, direction;
+	//when in the shutter interval the ray was sent, in [0, 1]; bounces keep their camera ray's time
+	float time;
 
+	//Rays through the neighbouring pixels in x and y. Only camera rays and their specular
+	//bounces carry them, to size texture lookups to what one pixel sees.
+	bool has_differentials{ false };
+	vec3 rx_origin, rx_direction;
+	vec3 ry_origin, ry_direction;
 };
 
 struct HitRecord
@@ -22,5 +30,47 @@ struct HitRecord
 	float t;
 	vec3 point;
 	vec3 normal;
-	std::shared_ptr<Material> mat;
-};
\ No newline at end of file
+	//surface parameterization, for textures
+	glm::vec2 uv{ 0.f };
+	//how the surface moves with uv, zero where there's no usable parameterization
+	vec3 dpdu{ 0.f }, dpdv{ 0.f };
+	//how the hit moves from pixel to pixel, and the largest change in uv that comes with it
+	vec3 dpdx{ 0.f }, dpdy{ 0.f };
+	float footprint{ 0.f };
+	//owned by the scene, which outlives every hit record
+	Material const* mat;
+	//whether the light hierarchy can pick this surface, so its emission may already have been sampled
+	bool light_sampled{ false };
+
+	//Intersects the offset rays with the tangent plane and solves for the matching change in uv,
+	//in the least squares sense since dpdu and dpdv only span the plane
+	void ComputeDifferentials(Ray const& ray)
+	{
+		if (!ray.has_differentials)
+		{
+			return;
+		}
+		float d = glm::dot(normal, point);
+		float nx = glm::dot(normal, ray.rx_direction), ny = glm::dot(normal, ray.ry_direction);
+		if (nx == 0 || ny == 0)
+		{
+			return;
+		}
+		dpdx = ray.rx_origin + ray.rx_direction * ((d - glm::dot(normal, ray.rx_origin)) / nx) - point;
+		dpdy = ray.ry_origin + ray.ry_direction * ((d - glm::dot(normal, ray.ry_origin)) / ny) - point;
+
+		float ata00 = glm::dot(dpdu, dpdu), ata01 = glm::dot(dpdu, dpdv), ata11 = glm::dot(dpdv, dpdv);
+		float det = ata00 * ata11 - ata01 * ata01;
+		if (!(std::abs(det) > 1e-20f))
+		{
+			return;
+		}
+		auto uv_change = [&](vec3 const& dp) -> glm::vec2
+		{
+			float atb0 = glm::dot(dpdu, dp), atb1 = glm::dot(dpdv, dp);
+			return glm::vec2(ata11 * atb0 - ata01 * atb1, ata00 * atb1 - ata01 * atb0) / det;
+		};
+		float f = glm::max(glm::length(uv_change(dpdx)), glm::length(uv_change(dpdy)));
+		footprint = std::isfinite(f) ? f : 0.f;
+	}
+};
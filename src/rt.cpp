@@ -1,161 +1,374 @@
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <chrono>
 #include <omp.h>
 
-#define STB_IMAGE_IMPLEMENTATION
 #include <3rdparty/stb_image.h>
-#define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <3rdparty/stb_image_write.h>
 
 
-//#define GLM_FORCE_SSE42 //if your processor supports it
-//#define GLM_FORCE_SSE2 //if your processor supports it
-#define GLM_FORCE_ALIGNED
-#define GLM_FORCE_AVX2
+#include <3rdparty/glm/glm.hpp>
 
-#include <3rdparty/glm/vec3.hpp>
-#include <3rdparty/glm/gtc/random.hpp>
+#include <Renderer.h>
+#include <Config.h>
+#include <ImageWriter.h>
+#include <AOV.h>
+#include <Denoiser.h>
+#include <Distributed.h>
+#include <Server.h>
+#include <Stats.h>
+#include <Trace.h>
+#include <Benchmark.h>
+#include <Kernels.h>
 
-#include "rt_math.h"
-#include <ray.h>
-#include <geometry.h>
-#include <Camera.h>
-#include <Material.h>
 
-
-using std::shared_ptr;
-using std::make_shared;
 using namespace geometry;
 
-int const RECURSION_DEPTH = 8;
-int const NUM_SAMPLES = 256;
-int const w = 512, h = 256;
+#if RT_STATS
+//false color PNG scaled to the most expensive pixel, or the raw cost per sample as .hdr
+void write_heatmap(std::string const& path)
+{
+	stats::Stats const& s = stats::get();
+	ivec2 size = s.HeatmapSize();
+	bool ok;
+	if (file_extension(path) == "hdr")
+	{
+		std::vector<float> rgb;
+		rgb.reserve(s.Heatmap().size() * 3);
+		for (float cost : s.Heatmap())
+		{
+			rgb.insert(rgb.end(), { cost, cost, cost });
+		}
+		ok = stbi_write_hdr(path.c_str(), size.x, size.y, 3, rgb.data()) != 0;
+	}
+	else
+	{
+		std::vector<unsigned char> rgb(s.Heatmap().size() * 3);
+		s.HeatmapToRGB8(rgb.data());
+		ok = stbi_write_png(path.c_str(), size.x, size.y, 3, rgb.data(), size.x * 3) != 0;
+	}
+	if (!ok)
+	{
+		std::cerr << "Could not write heatmap " << path << std::endl;
+	}
+}
+#endif
 
-vec3 color(Ray const& r, Hitable& world, int recursion_num)
+//Renders the benchmark scenes one after the other with fixed settings and seeds and writes the report.
+//The command line only picks the thread count, seed and BVH build.
+int run_benchmarks(RenderSettings const& base)
 {
-	HitRecord rec;
-	bool intersection = world.Intersect(r, vec2(0.001, FLT_MAX), rec);
-	//FIXME (OS): Magic number
-	if (intersection)
+	typedef std::chrono::high_resolution_clock clock;
+	std::vector<benchmark::SceneSpec> const scenes = {
+		{ "spheres-4", [](Scene& scene) { rt::build_default_scene(scene, 4); } },
+		{ "spheres-11", [](Scene& scene) { rt::build_default_scene(scene, 11); } },
+		{ "spheres-22", [](Scene& scene) { rt::build_default_scene(scene, 22); } },
+		{ "mesh-300", [](Scene& scene) { benchmark::build_dense_mesh(scene, 300); } },
+		{ "glass", benchmark::build_glass_scene },
+	};
+	std::vector<benchmark::Result> results;
+	for (benchmark::SceneSpec const& spec : scenes)
 	{
-		Ray scattered(vec3(0), vec3(0));
-		vec3 attenuation;
-		bool does_scatter = rec.mat->Scatter(r, rec, attenuation, scattered);
-		if (does_scatter && (recursion_num < RECURSION_DEPTH))
+		rt::Renderer renderer(benchmark::render_settings(base));
+		RenderSettings& settings = renderer.Settings();
+		Scene& world = renderer.World();
+		srand(unsigned(settings.seed));
+		clock::time_point scene_start = clock::now();
+		spec.build(world);
+		clock::time_point build_start = clock::now();
+		renderer.Build();
+		clock::time_point build_end = clock::now();
+		for (auto const& setting : world.settings)
 		{
-			return attenuation * color(scattered, world, recursion_num + 1);
+			if (!config::apply(settings, setting.first, setting.second))
+			{
+				return 1;
+			}
 		}
-		else
+
+		Film film(settings.width, settings.height, settings.tile_size, FilterTable(settings.filter, settings.filter_radius));
+		srand(unsigned(settings.seed));
+		renderer.ResetStats();
+#if RT_STATS
+		stats::get().Reset(settings.width, settings.height);
+#endif
+		clock::time_point render_start = clock::now();
+		renderer.Render(film);
+		clock::time_point render_end = clock::now();
+
+		RayCounter const& rays = renderer.Rays();
+		benchmark::Result result;
+		result.name = spec.name;
+		result.spheres = world.spheres.size();
+		result.triangles = world.triangles.size();
+		result.nodes = world.bvh.nodes.size();
+		result.scene_seconds = std::chrono::duration<double>(build_start - scene_start).count();
+		result.bvh_seconds = std::chrono::duration<double>(build_end - build_start).count();
+		result.render_seconds = std::chrono::duration<double>(render_end - render_start).count();
+		for (int type = 0; type < int(RayType::Count); ++type)
 		{
-			return vec3(0);
+			result.rays[type] = rays.Total(RayType(type));
 		}
+		results.push_back(result);
+		std::cout << spec.name << ": bvh " << result.bvh_seconds << "s, render " << result.render_seconds << "s, "
+			<< rays.Total() / result.render_seconds * 1e-6 << " Mrays/s" << std::endl;
+#if RT_STATS
+		stats::get().Print(std::cout, rays.Total());
+#endif
 	}
+	return benchmark::write_report(base.benchmark, base, omp_get_max_threads(), results) ? 0 : 1;
+}
 
-	// sky shading
-	vec3 dir = r.direction;
+//Renders the loaded scene with the renderer's settings into their outputs, building the BVH and
+//loading the sky first if needed. args is the command line, which a coordinator passes on to its workers.
+int render_frame(rt::Renderer& renderer, std::vector<std::string> const& args)
+{
+	typedef std::chrono::high_resolution_clock clock;
+	RenderSettings const& settings = renderer.Settings();
+	Scene const& world = renderer.World();
 
-	dir /= sqrt(dot(r.direction, r.direction));
-	float t = 0.5 * (dir.y + 1.0);
-	vec3 sky = r.direction * vec3(.5f) + vec3(.5f);
-	//vec3 sky = lerp(vec3(1, 1, 1), vec3(.5, .7, 1), t);
-	return sky;
-}
+	//a coordinator only needs the scene's settings, the workers build their own BVH
+	bool const distributed = !settings.coordinator.empty();
+	if (!distributed && !renderer.Built())
+	{
+		clock::time_point build_start = clock::now();
+		renderer.Build();
+		if (!renderer.FromCache())
+		{
+			std::chrono::duration<double> build_time = clock::now() - build_start;
+			std::cout << "bvh: " << build_time.count() << "s, " << world.bvh.nodes.size() << " nodes" << std::endl;
+		}
+	}
 
+	if (!distributed && !renderer.LoadEnvironment(settings.environment))
+	{
+		return 1;
+	}
+	
+	int const w = settings.width, h = settings.height;
+	Film film(w, h, settings.tile_size, FilterTable(settings.filter, settings.filter_radius));
+	//the denoiser needs the AOVs as guides even if they aren't written
+	std::unique_ptr<AOVBuffers> aovs((settings.aovs || settings.denoise) ? new AOVBuffers(w, h) : nullptr);
 
-vec3 sample(Hitable& world, Camera const& camera, ivec2 const& pos, int const num_samples, Randomization const randomization)
-{
-	vec3 accum;
-	for (int i = 0; i < num_samples; ++i)
+	std::vector<std::string> png_outputs;
+	std::vector<std::unique_ptr<TileWriter> > writers;
+	bool aovs_written = false;
+	for (std::string const& output_path : settings.outputs)
 	{
-		Ray r = camera.make_ray(pos, randomization);
-		accum += color(r, world, 0);
+		if (file_extension(output_path) == "png")
+		{
+			png_outputs.push_back(output_path);
+			continue;
+		}
+		std::vector<OutputChannel> channels = beauty_channels();
+		bool aovs_in_beauty = settings.aovs && !aovs_written && (file_extension(output_path) == "exr");
+		if (aovs_in_beauty)
+		{
+			for (OutputChannel const& channel : aovs->Channels())
+			{
+				channels.push_back(channel);
+			}
+		}
+		std::unique_ptr<TileWriter> writer = make_tile_writer(output_path, channels);
+		if (!writer)
+		{
+			std::cerr << "Unsupported output format: " << output_path << std::endl;
+			return 1;
+		}
+		if (!writer->Open(output_path, film))
+		{
+			return 1;
+		}
+		writers.push_back(std::move(writer));
+		aovs_written = aovs_written || aovs_in_beauty;
+	}
+	if (settings.aovs && !aovs_written && !settings.outputs.empty())
+	{
+		std::string const& first = settings.outputs.front();
+		std::string aov_path = first.substr(0, first.find_last_of('.')) + ".aovs.exr";
+		std::unique_ptr<TileWriter> aov_writer(new ExrWriter(aovs->Channels()));
+		if (!aov_writer->Open(aov_path, film))
+		{
+			return 1;
+		}
+		writers.push_back(std::move(aov_writer));
 	}
-	accum *= 1.0f / num_samples;
-	return accum;
-}
 
-int trace(Hitable& world, int w, int h, unsigned char * img)
-{
-	vec3 pos = vec3(8.5, 1.8, -2.4f);
-	Camera camera(58.f, pos, vec3(0., 1., 0.), vec3(0., 0., 0), length(pos - vec3(4,1,0)), .075);
-	camera.set_image_size(ivec2(w, h));
-	#pragma omp parallel for
-	for (int j = 0; j < h; ++j)
+	std::vector<TileWriter*> tile_writers;
+	for (std::unique_ptr<TileWriter> const& writer : writers)
 	{
-		#pragma omp parallel for
-		for (int i = 0; i < w; ++i)
+		tile_writers.push_back(writer.get());
+	}
+	
+#if RT_STATS
+	stats::get().Reset(w, h);
+#else
+	if (!settings.heatmap.empty())
+	{
+		std::cerr << "The heatmap needs a build with RT_STATS=1" << std::endl;
+	}
+#endif
+	clock::time_point render_start = clock::now();
+
+	//when denoising, tiles are only final after the post-pass
+	int result;
+	{
+		TRACE_SCOPE("render");
+		if (distributed)
+		{
+			if (!distributed::coordinate(settings, args, film, tile_writers))
+			{
+				return 1;
+			}
+			result = 0;
+		}
+		else
 		{
-			vec3 c = sample(world, camera, ivec2(i, j), NUM_SAMPLES, Randomization::MonteCarlo);
-			c = sqrt(c);
-			//magic number for float truncation
-			img[(j*w + i) * 3 + 0] = int(c.r * 255.99);
-			img[(j*w + i) * 3 + 1] = int(c.g * 255.99);
-			img[(j*w + i) * 3 + 2] = int(c.b * 255.99);
+			result = renderer.Render(film, aovs.get(), settings.denoise ? std::vector<TileWriter*>() : tile_writers);
 		}
 	}
-	return 0;
-}
 
-int main()
-{
-	unsigned char *img = new unsigned char[w * h * 3];
+	if (result != 0)
+	{
+		return result;
+	}
 
-	HitableList world;
+	std::chrono::duration<double> render_time = clock::now() - render_start;
+	std::cout << "render: " << render_time.count() << "s" << std::endl;
+	if (settings.temporal && !distributed)
+	{
+		std::cout << "temporal: " << 100.0 * renderer.Temporal().Reused() / (size_t(w) * h) << "% of pixels reused" << std::endl;
+	}
+#if RT_STATS
+	stats::get().Print(std::cout, renderer.Rays().Total());
+	if (!settings.heatmap.empty())
+	{
+		write_heatmap(settings.heatmap);
+	}
+#endif
+	if (!world.textures.empty())
+	{
+		uint64_t lookups = world.texture_cache.Hits() + world.texture_cache.Misses();
+		std::cout << "textures: " << world.texture_cache.Misses() << " tiles read, "
+			<< 100.0 * world.texture_cache.Hits() / glm::max(lookups, uint64_t(1)) << "% cache hits" << std::endl;
+	}
 
-	int n = 4;
-	
-	//hacky floor in the form of a sphere
-	auto floor = make_shared<Sphere>(vec3(0, -1000, 0), 1000);
-	floor->material = make_shared<Lambertian>(vec3(0.2f, 0.2, 0.7));
-	world.Add(floor);
+	std::unique_ptr<Film> denoised(settings.denoise ? new Film(w, h, film.TileSize()) : nullptr);
+	Film const& output = settings.denoise ? *denoised : film;
+	if (settings.denoise)
+	{
+		clock::time_point denoise_start = clock::now();
+		{
+			TRACE_SCOPE("denoise");
+			Denoiser().Apply(film, *aovs, *denoised);
+		}
+		std::chrono::duration<double> denoise_time = clock::now() - denoise_start;
+		std::cout << "denoise: " << denoise_time.count() << "s" << std::endl;
+
+		TRACE_SCOPE("write tiles");
+		for (int tile = 0; tile < output.TileCount(); ++tile)
+		{
+			for (TileWriter* writer : tile_writers)
+			{
+				writer->WriteTile(output, tile);
+			}
+		}
+	}
 
-	for (int a = -n; a < n; ++a)
+	for (std::unique_ptr<TileWriter> const& writer : writers)
 	{
-		for (int b = -n; b < n; ++b)
+		TRACE_SCOPE("close output");
+		if (!writer->Close())
+		{
+			result = 1;
+		}
+	}
+	if (!png_outputs.empty())
+	{
+		unsigned char *img = new unsigned char[w * h * 3];
+		{
+			TRACE_SCOPE("resolve rgb8");
+			output.ToRGB8(img);
+		}
+		for (std::string const& path : png_outputs)
 		{
-			float choose_mat = linearRand(0.f, 1.f);
-			vec3 center(a + 0.9* linearRand(0.f, 1.f), 0.2, b + 0.9 * linearRand(0.f, 1.f));
-			if (length(center - vec3(4.0, 0.2, 0)) > .9)
+			TRACE_SCOPE("stbi_write_png");
+			if (!stbi_write_png(path.c_str(), w, h, 3, img, w*3))
 			{
-				auto sphere = make_shared<Sphere>(center, 0.2f);
-				world.Add(sphere);
-				if (choose_mat < 0.8)
-				{
-					vec3 c = linearRand(vec3(0.f), vec3(1.f));
-					c = c*c;
-					sphere->material = make_shared<Lambertian>(c);
-				}
-				else if (choose_mat < 0.95)
-				{
-					sphere->material = make_shared<Metal>(linearRand(vec3(.5f), vec3(1.f)), linearRand(0.f, 0.5f));
-				}
-				else
-				{
-					sphere->material = make_shared<Dielectric>(1.5);
-				}
+				std::cerr << "Could not write " << path << std::endl;
+				result = 1;
 			}
 		}
+		delete[] img;
 	}
 
-	//Hero spheres
-	auto crazy = make_shared<Sphere>(vec3(0, 1, 0), 1.0);
-	crazy->material = make_shared<Dielectric>(1.5);
-	auto sexy = make_shared<Sphere>(vec3(-4, 1, 0), 1.0);
-	sexy->material = make_shared<Lambertian>(vec3(0.5, 0.2, 0.5));
-	auto cool = make_shared<Sphere>(vec3(4, 1, 0), 1.0);
-	cool->material = make_shared<Metal>(vec3(0.7, 0.6, 0.5), 0);
-	world.Add(crazy);
-	world.Add(sexy);
-	world.Add(cool);
+	return result;
+}
 
-	BVHNode bvh(world);
-	
-	int result;
-	result = trace(bvh, w, h, img);
+//The command line renderer, a thin shell around rt::Renderer: settings in, image files out
+int main(int argc, char** argv)
+{
+	rt::Renderer renderer;
+	RenderSettings& settings = renderer.Settings();
+	if (!config::parse_command_line(settings, argc, argv))
+	{
+		return 1;
+	}
+	if (settings.threads > 0)
+	{
+		omp_set_num_threads(settings.threads);
+	}
+	//the counter was sized for the default thread count
+	renderer.ResetStats();
+	kernels::select(settings.isa);
+	//a server reading requests from stdin answers on stdout
+	std::ostream& log = (settings.serve == "-") ? std::cerr : std::cout;
+	log << "cpu: " << cpu::name(kernels::active().isa) << " kernels (detected " << cpu::name(cpu::detect()) << ")" << std::endl;
+	if (!settings.trace.empty())
+	{
+		tracing::Tracer::get().Start(settings.trace);
+	}
+	if (!settings.benchmark.empty())
+	{
+		return run_benchmarks(settings);
+	}
+	if (!settings.worker.empty())
+	{
+		return distributed::work(settings.worker, std::vector<std::string>(argv, argv + argc));
+	}
+	if (!settings.serve.empty())
+	{
+		return server::serve(settings.serve, std::vector<std::string>(argv, argv + argc),
+			[](rt::Renderer& renderer, std::vector<std::string> const& args) { return render_frame(renderer, args) == 0; });
+	}
+	srand(unsigned(settings.seed));
+	typedef std::chrono::high_resolution_clock clock;
 
-	stbi_write_png("image.png", w, h, 3, img, w*3);
+	Scene const& world = renderer.World();
+	clock::time_point load_start = clock::now();
+	if (!renderer.LoadScene())
+	{
+		return 1;
+	}
+	if (!world.settings.empty())
+	{
+		//the scene's camera applies first, then the command line again so it has the last word
+		for (auto const& setting : world.settings)
+		{
+			if (!config::apply(settings, setting.first, setting.second))
+			{
+				return 1;
+			}
+		}
+		if (!config::parse_command_line(settings, argc, argv))
+		{
+			return 1;
+		}
+	}
+	std::chrono::duration<double> load_time = clock::now() - load_start;
+	std::cout << "scene: " << load_time.count() << "s" << (renderer.FromCache() ? " from cache, " : ", ") << world.spheres.size() << " spheres, "
+		<< world.triangles.size() << " triangles, " << world.materials.size() << " materials" << std::endl;
 
-	delete[] img;
-	return 0;
-}
\ No newline at end of file
+	return render_frame(renderer, std::vector<std::string>(argv, argv + argc));
+}
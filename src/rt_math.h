@@ -1,27 +1,29 @@
 #pragma once
-#include "3rdparty\glm\glm.hpp"
-#include "3rdparty\glm\gtc\random.hpp"
+#include <cmath>
+#include <3rdparty/glm/glm.hpp>
+#include <3rdparty/glm/gtc/random.hpp>
+#include <3rdparty/glm/gtc/constants.hpp>
 
 using glm::vec3;
 using glm::vec2;
 
-float sum_parts(vec3 const& v)
+inline float sum_parts(vec3 const& v)
 {
 	return v.x + v.y + v.z;
 }
 
-vec3 reflect(vec3 in, vec3 normal)
+inline vec3 reflect(vec3 in, vec3 normal)
 {
 	return in - 2.f * dot(in, normal) * normal;
 }
 
-bool refract(vec3 in, vec3 normal, float ni_over_no, vec3& refracted)
+inline bool refract(vec3 in, vec3 normal, float ni_over_no, vec3& refracted)
 {
 	float h = dot(normalize(in), normal);
 	float discriminant = 1 - ni_over_no * ni_over_no * (1 - h * h);
 	if (discriminant > 0)
 	{
-		refracted = ni_over_no * (in - normal * h) - normal * sqrt(discriminant);
+		refracted = ni_over_no * (in - normal * h) - normal * std::sqrt(discriminant);
 		return true;
 	}
 	else
@@ -30,7 +32,7 @@ bool refract(vec3 in, vec3 normal, float ni_over_no, vec3& refracted)
 	}
 }
 
-float schlick(float costheta, float index)
+inline float schlick(float costheta, float index)
 {
 	float r0 = (1 - index) / (1 + index);
 	r0 *= r0;
@@ -40,7 +42,7 @@ float schlick(float costheta, float index)
 }
 
 
-vec3 sample_in_sphere(vec3 center, vec3 radius)
+inline vec3 sample_in_sphere(vec3 center, vec3 radius)
 {
 	vec3 out;
 	do 
@@ -50,7 +52,7 @@ vec3 sample_in_sphere(vec3 center, vec3 radius)
 	return out * radius + center;
 }
 
-vec2 sample_in_disk(vec2 center, vec2 radius)
+inline vec2 sample_in_disk(vec2 center, vec2 radius)
 {
 	vec2 out;
 	do
@@ -66,3 +68,26 @@ inline vec3 lerp(vec3 const v1, vec3 const v2, float t)
 	return v1 * (1 - t) + v2 * t;
 }
 
+inline float luminance(vec3 const& c)
+{
+	return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+//builds two tangents so that (t, b, n) is orthonormal
+inline void make_frame(vec3 const& n, vec3& t, vec3& b)
+{
+	t = (std::abs(n.x) > 0.9f) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	t = normalize(cross(n, t));
+	b = cross(n, t);
+}
+
+//uniform direction inside the cone around axis with half-angle acos(cos_max)
+inline vec3 sample_in_cone(vec3 const& axis, float cos_max, vec2 const& u)
+{
+	float cos_theta = 1.f - u.x * (1.f - cos_max);
+	float sin_theta = sqrt(glm::max(0.f, 1.f - cos_theta * cos_theta));
+	float phi = glm::two_pi<float>() * u.y;
+	vec3 t, b;
+	make_frame(axis, t, b);
+	return (t * std::cos(phi) + b * std::sin(phi)) * sin_theta + axis * cos_theta;
+}
@@ -0,0 +1,5 @@
+//stb's implementations, compiled once for everything that reads or writes images
+#define STB_IMAGE_IMPLEMENTATION
+#include <3rdparty/stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <3rdparty/stb_image_write.h>